@@ -0,0 +1,720 @@
+#include "analysis.hpp"
+#include "kmeans.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+std::vector<ColorGroup> colorGroups = {
+    {"Miscellaneous", 0, 0, 0.0f, 0.0f, 0.0f, 0.0f, cv::Vec3b(0, 0, 0)},
+    {"Blue_Cool", 200, 260, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(255, 100, 50)},
+    {"Red_Warm", 340, 20, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(50, 50, 255)},
+    {"Green_Nature", 80, 140, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(50, 255, 100)},
+    {"Orange_Sunset", 20, 50, 0.4f, 1.0f, 0.4f, 1.0f, cv::Vec3b(50, 165, 255)},
+    {"Purple_Mystical", 260, 300, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(255, 50, 200)},
+    {"Yellow_Bright", 50, 80, 0.4f, 1.0f, 0.5f, 1.0f, cv::Vec3b(50, 255, 255)},
+    {"Pink_Soft", 300, 340, 0.3f, 1.0f, 0.4f, 1.0f, cv::Vec3b(200, 100, 255)},
+    {"Cyan_Tech", 160, 200, 0.4f, 1.0f, 0.4f, 1.0f, cv::Vec3b(255, 200, 100)},
+    {"Dark_Moody", 0, 360, 0.0f, 1.0f, 0.0f, 0.25f, cv::Vec3b(40, 40, 40)},
+    {"Light_Minimal", 0, 360, 0.0f, 0.3f, 0.8f, 1.0f, cv::Vec3b(240, 240, 240)},
+    {"Monochrome", 0, 360, 0.0f, 0.15f, 0.25f, 0.8f, cv::Vec3b(128, 128, 128)},
+    {"Earth_Tones", 25, 45, 0.2f, 0.7f, 0.3f, 0.7f, cv::Vec3b(100, 150, 200)}};
+
+bool loadColorGroups(const std::string& path, std::string& error)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        error = "Could not open " + path;
+        return false;
+    }
+
+    std::vector<ColorGroup> groups = {colorGroups[0]};
+    std::set<std::string> names = {colorGroups[0].name};
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+
+        std::istringstream fields(line);
+        ColorGroup group;
+        int b, g, r;
+        std::string rest;
+        bool parsed = static_cast<bool>(fields >> group.name >> group.hueMin >> group.hueMax >> group.satMin >> group.satMax >>
+                                        group.brightMin >> group.brightMax >> b >> g >> r) &&
+                      !(fields >> rest);
+        bool valid = parsed && group.hueMin >= 0 && group.hueMin <= 360 && group.hueMax >= 0 && group.hueMax <= 360 &&
+                     group.satMin >= 0 && group.satMin <= group.satMax && group.satMax <= 1 &&
+                     group.brightMin >= 0 && group.brightMin <= group.brightMax && group.brightMax <= 1 &&
+                     b >= 0 && b <= 255 && g >= 0 && g <= 255 && r >= 0 && r <= 255;
+        if (!valid) {
+            error = path + ":" + std::to_string(lineNumber) +
+                    ": expected name, hue min/max (0-360), saturation min/max and brightness min/max (0-1), B G R (0-255)";
+            return false;
+        }
+        if (!names.insert(group.name).second) {
+            error = path + ":" + std::to_string(lineNumber) + ": group " + group.name + " is defined twice";
+            return false;
+        }
+        group.representativeColor = cv::Vec3b(b, g, r);
+        groups.push_back(group);
+    }
+
+    if (groups.size() == 1) {
+        error = path + ": no groups defined";
+        return false;
+    }
+    colorGroups = std::move(groups);
+    return true;
+}
+
+uint64_t colorGroupsHash()
+{
+    std::vector<unsigned char> bytes;
+    auto append = [&bytes](const void* data, size_t size) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        bytes.insert(bytes.end(), p, p + size);
+    };
+    for (const ColorGroup& group : colorGroups) {
+        append(group.name.c_str(), group.name.size() + 1);
+        const float ranges[6] = {group.hueMin, group.hueMax, group.satMin, group.satMax, group.brightMin, group.brightMax};
+        append(ranges, sizeof(ranges));
+        append(&group.representativeColor[0], 3);
+    }
+    return hashBytes(bytes.data(), bytes.size());
+}
+
+// cv::cvtColor(COLOR_BGR2HSV) of one 8-bit pixel without going through 1x1 Mats: OpenCV's integer formula and
+// its two division tables (12 fractional bits, rounded half to even like cvRound), built at compile time.
+// Gives the same H (0-180), S and V bytes.
+constexpr int HSV_SHIFT = 12;
+constexpr int HSV_HUES = 181;
+
+constexpr int roundedDivision(int64_t num, int64_t den)
+{
+    int64_t q = num / den, twice = 2 * (num % den);
+    return static_cast<int>(twice > den || (twice == den && (q & 1)) ? q + 1 : q);
+}
+
+struct HsvDivisors {
+    int sat[256];
+    int hue[256];
+};
+
+constexpr HsvDivisors makeHsvDivisors()
+{
+    HsvDivisors d{};
+    for (int i = 1; i < 256; i++) {
+        d.sat[i] = roundedDivision(255 << HSV_SHIFT, i);
+        d.hue[i] = roundedDivision(180 << HSV_SHIFT, 6 * i);
+    }
+    return d;
+}
+
+constexpr HsvDivisors HSV_DIVISORS = makeHsvDivisors();
+
+static cv::Vec3b bgrToHsv(const cv::Vec3b& bgr)
+{
+    int b = bgr[0], g = bgr[1], r = bgr[2];
+    int v = std::max({b, g, r});
+    int diff = v - std::min({b, g, r});
+
+    int s = (diff * HSV_DIVISORS.sat[v] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+    int h = v == r ? g - b : v == g ? b - r + 2 * diff : r - g + 4 * diff;
+    h = (h * HSV_DIVISORS.hue[diff] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+    if (h < 0) h += 180;
+    return cv::Vec3b(static_cast<uchar>(h), static_cast<uchar>(s), static_cast<uchar>(v));
+}
+
+void calculateColorProperties(ColorInfo& colorInfo)
+{
+    cv::Vec3b hsv = bgrToHsv(colorInfo.color);
+    colorInfo.hue = hsv[0] * 2.0;
+    colorInfo.saturation = hsv[1] / 255.0;
+    colorInfo.brightness = hsv[2] / 255.0;
+}
+
+// BGR of an HSV color with hue in degrees and saturation in [0, 1], value in [0, 255]
+static cv::Vec3b hsvToBgr(double hue, double saturation, double value)
+{
+    double chroma = value * saturation;
+    double sector = std::fmod(hue, 360.0) / 60.0;
+    double second = chroma * (1.0 - std::abs(std::fmod(sector, 2.0) - 1.0));
+    double r = 0, g = 0, b = 0;
+    switch (static_cast<int>(sector)) {
+        case 0: r = chroma, g = second; break;
+        case 1: r = second, g = chroma; break;
+        case 2: g = chroma, b = second; break;
+        case 3: g = second, b = chroma; break;
+        case 4: r = second, b = chroma; break;
+        default: r = chroma, b = second; break;
+    }
+    double m = value - chroma;
+    auto channel = [m](double c) { return static_cast<uchar>(std::clamp(std::lround(c + m), 0L, 255L)); };
+    return cv::Vec3b(channel(b), channel(g), channel(r));
+}
+
+// 36 hue x 16 saturation x 16 value bins over OpenCV's 8-bit HSV, index (h * 16 + s) * 16 + v
+constexpr int HIST_HUES = 36, HIST_SATS = 16, HIST_VALS = 16;
+
+// the k fullest peaks of the HSV histogram (bins climbing to the same local maximum are one peak), heaviest
+// first, each the center of its fullest bin
+std::vector<ColorInfo> extractDominantColorsHistogram(const cv::Mat& image, int k)
+{
+    const int bins = HIST_HUES * HIST_SATS * HIST_VALS;
+    std::vector<uint32_t> count(bins, 0);
+    for (int y = 0; y < image.rows; y++) {
+        const cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < image.cols; x++) {
+            cv::Vec3b hsv = bgrToHsv(row[x]);
+            int h = std::min(hsv[0] / 5, HIST_HUES - 1);
+            count[(h * HIST_SATS + (hsv[1] >> 4)) * HIST_VALS + (hsv[2] >> 4)]++;
+        }
+    }
+
+    auto fuller = [&count](int a, int b) { return count[a] > count[b] || (count[a] == count[b] && a > b); };
+    std::vector<int> up(bins);
+    for (int bin = 0; bin < bins; bin++) {
+        up[bin] = bin;
+        if (count[bin] == 0) continue;
+        int h = bin / (HIST_SATS * HIST_VALS), s = bin / HIST_VALS % HIST_SATS, v = bin % HIST_VALS;
+        for (int dh = -1; dh <= 1; dh++) {
+            int nh = (h + dh + HIST_HUES) % HIST_HUES;
+            for (int ns = std::max(s - 1, 0); ns <= std::min(s + 1, HIST_SATS - 1); ns++) {
+                for (int nv = std::max(v - 1, 0); nv <= std::min(v + 1, HIST_VALS - 1); nv++) {
+                    int neighbor = (nh * HIST_SATS + ns) * HIST_VALS + nv;
+                    if (fuller(neighbor, up[bin])) up[bin] = neighbor;
+                }
+            }
+        }
+    }
+
+    std::vector<uint64_t> mass(bins, 0);
+    std::vector<int> peaks;
+    for (int bin = 0; bin < bins; bin++) {
+        if (count[bin] == 0) continue;
+        int top = bin;
+        while (up[top] != top) top = up[top];
+        up[bin] = top;
+        if (bin == top) peaks.push_back(top);
+        mass[top] += count[bin];
+    }
+
+    auto heavier = [&mass](int a, int b) { return mass[a] > mass[b] || (mass[a] == mass[b] && a < b); };
+    size_t numColors = std::min(peaks.size(), static_cast<size_t>(std::max(k, 0)));
+    std::nth_element(peaks.begin(), peaks.begin() + numColors, peaks.end(), heavier);
+    std::sort(peaks.begin(), peaks.begin() + numColors, heavier);
+
+    std::vector<ColorInfo> colors;
+    for (size_t i = 0; i < numColors; i++) {
+        int peak = peaks[i];
+        int h = peak / (HIST_SATS * HIST_VALS), s = peak / HIST_VALS % HIST_SATS, v = peak % HIST_VALS;
+
+        // bin centers: hue in OpenCV's 2 degree units, saturation and value in 0-255
+        double hue = (h + 0.5) * 180.0 / HIST_HUES;
+        double sat = (s + 0.5) * 256.0 / HIST_SATS;
+        double val = (v + 0.5) * 256.0 / HIST_VALS;
+
+        ColorInfo colorInfo;
+        colorInfo.color = hsvToBgr(hue * 2.0, sat / 255.0, val);
+        colorInfo.weight = (double)mass[peak] / image.total();
+        colorInfo.hue = hue * 2.0; // Convert to 0-360 range
+        colorInfo.saturation = sat / 255.0;
+        colorInfo.brightness = val / 255.0;
+        colors.push_back(colorInfo);
+    }
+
+    return colors;
+}
+
+// cluster centers sorted by weight (share of the pixels), most dominant first
+static std::vector<ColorInfo> colorsFromClusters(const KmeansResult& result, size_t totalPixels)
+{
+    std::vector<ColorInfo> colors;
+    for (size_t i = 0; i < result.centers.size(); i++) {
+        ColorInfo colorInfo;
+        colorInfo.color = cv::Vec3b(
+            static_cast<uchar>(std::clamp(result.centers[i][0], 0.0f, 255.0f)),
+            static_cast<uchar>(std::clamp(result.centers[i][1], 0.0f, 255.0f)),
+            static_cast<uchar>(std::clamp(result.centers[i][2], 0.0f, 255.0f)));
+        colorInfo.weight = (double)result.counts[i] / totalPixels;
+        calculateColorProperties(colorInfo);
+        colors.push_back(colorInfo);
+    }
+
+    std::sort(colors.begin(), colors.end(),
+              [](const ColorInfo& a, const ColorInfo& b) {
+                  return a.weight > b.weight;
+              });
+
+    return colors;
+}
+
+KmeansSeeding kmeansSeeding = KmeansSeeding::PLUS_PLUS;
+int kmeansPyramid = 0;
+
+// k-means settings of one algorithm with the seeding picked on the command line; the representative colors
+// of the groups (all but Miscellaneous) are the anchors
+static KmeansParams kmeansParams(int k, int maxIterations, int attempts)
+{
+    KmeansParams params;
+    params.k = k;
+    params.maxIterations = maxIterations;
+    params.attempts = attempts;
+    params.seeding = kmeansSeeding;
+    params.pyramid = kmeansPyramid;
+    if (kmeansSeeding == KmeansSeeding::ANCHORS) {
+        for (size_t i = 1; i < colorGroups.size(); i++) {
+            const cv::Vec3b& c = colorGroups[i].representativeColor;
+            params.anchors.push_back(cv::Vec3f(c[0], c[1], c[2]));
+        }
+    }
+    return params;
+}
+
+std::vector<ColorInfo> extractDominantColorsKmeansOpt(const cv::Mat& image, int k)
+{
+    // Reduce image size for faster processing
+    cv::Mat smallImage;
+    int maxDim = 150; // Much smaller than 800x600
+    if (image.rows > maxDim || image.cols > maxDim) {
+        double scale = std::min((double)maxDim / image.rows, (double)maxDim / image.cols);
+        cv::resize(image, smallImage, cv::Size(), scale, scale);
+    }
+    else {
+        smallImage = image;
+    }
+
+    KmeansParams params = kmeansParams(k, 10, 1); // Reduced iterations and attempts
+
+    return colorsFromClusters(kmeansColors(smallImage, params), smallImage.total());
+}
+
+std::vector<ColorInfo> extractDominantColorsKmeans(const cv::Mat& image, int k)
+{
+    KmeansParams params = kmeansParams(k, 20, 3);
+
+    return colorsFromClusters(kmeansColors(image, params), image.total());
+}
+
+// weighted k-means over the distinct 5-bit colors, cheap enough for the full 800x600 box
+std::vector<ColorInfo> extractDominantColorsKmeansHistogram(const cv::Mat& image, int k)
+{
+    KmeansParams params = kmeansParams(k, 20, 3);
+
+    return colorsFromClusters(kmeansHistogram(image, params, 5), image.total());
+}
+
+// same clusters as KMEANS, distances that cannot change an assignment are skipped (see kmeansCounters)
+std::vector<ColorInfo> extractDominantColorsKmeansBounded(const cv::Mat& image, int k)
+{
+    KmeansParams params = kmeansParams(k, 20, 3);
+    params.bounded = true;
+
+    return colorsFromClusters(kmeansColors(image, params), image.total());
+}
+
+// same colors for the same pixels on every run, no iterations
+std::vector<ColorInfo> extractDominantColorsMedianCut(const cv::Mat& image, int k)
+{
+    return colorsFromClusters(medianCutColors(image, k, 5), image.total());
+}
+
+// cv::kmeans on float data, kept as the reference the kmeans.hpp engine is compared against
+std::vector<ColorInfo> extractDominantColorsKmeansOpenCV(const cv::Mat& image, int k)
+{
+    cv::Mat data = image.reshape(1, image.rows * image.cols);
+    data.convertTo(data, CV_32F);
+
+    cv::Mat labels, centers;
+    cv::kmeans(data, k, labels,
+               cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20, 1.0),
+               3, cv::KMEANS_PP_CENTERS, centers);
+
+    std::vector<int> counts(k, 0);
+    for (int i = 0; i < labels.rows; i++) {
+        counts[labels.at<int>(i)]++;
+    }
+
+    std::vector<ColorInfo> colors;
+    int totalPixels = image.rows * image.cols;
+
+    for (int i = 0; i < k; i++) {
+        ColorInfo colorInfo;
+        colorInfo.color = cv::Vec3b(
+            static_cast<uchar>(centers.at<float>(i, 0)),
+            static_cast<uchar>(centers.at<float>(i, 1)),
+            static_cast<uchar>(centers.at<float>(i, 2)));
+        colorInfo.weight = (double)counts[i] / totalPixels;
+        calculateColorProperties(colorInfo);
+        colors.push_back(colorInfo);
+    }
+
+    std::sort(colors.begin(), colors.end(),
+              [](const ColorInfo& a, const ColorInfo& b) {
+                  return a.weight > b.weight;
+              });
+
+    return colors;
+}
+
+static bool hueInGroup(double hue, const ColorGroup& group)
+{
+    if (group.hueMin > group.hueMax) { // wraparound case (red)
+        return hue >= group.hueMin || hue <= group.hueMax;
+    }
+    return hue >= group.hueMin && hue <= group.hueMax;
+}
+
+// distance to the nearer end of the hue range, also from inside it, in half turns
+static double hueDistance(double hue, const ColorGroup& group)
+{
+    if (group.hueMin > group.hueMax) {
+        return std::min({std::abs(hue - group.hueMin),
+                         std::abs(hue - group.hueMax),
+                         std::abs(hue - (group.hueMin - 360)),
+                         std::abs(hue - (group.hueMax + 360))}) /
+               180.0;
+    }
+    return std::min(std::abs(hue - group.hueMin), std::abs(hue - group.hueMax)) / 180.0;
+}
+
+// 0 inside [min, max]
+static double rangeDistance(double value, float min, float max)
+{
+    return std::max(0.0, std::max(min - value, value - max));
+}
+
+// 1 inside all three ranges, partial score for near matches
+static double colorScore(bool hueMatch, double hueDist, double satDist, double brightDist)
+{
+    if (hueMatch && satDist == 0.0 && brightDist == 0.0) return 1.0;
+    return std::max(0.0, 1.0 - (hueDist + satDist + brightDist) / 3.0);
+}
+
+double calculateGroupScore(const std::vector<ColorInfo>& colors, const ColorGroup& group)
+{
+    double score = 0.0;
+    double totalWeight = 0.0;
+
+    for (const auto& color : colors) {
+        double c = colorScore(hueInGroup(color.hue, group), hueDistance(color.hue, group),
+                              rangeDistance(color.saturation, group.satMin, group.satMax),
+                              rangeDistance(color.brightness, group.brightMin, group.brightMax));
+        score += c * color.weight;
+        totalWeight += color.weight;
+    }
+
+    return totalWeight > 0 ? score / totalWeight : 0.0;
+}
+
+// calculateGroupScore's terms for every 8-bit HSV value (hue in OpenCV's 2 degree steps) and every group, so a
+// color from calculateColorProperties is scored with table reads. Same functions, same doubles. Each row holds
+// all groups side by side ([value * groups + group]): one color scores every group in a loop that vectorizes.
+struct GroupScoreTables {
+    size_t groups = 0;
+    std::vector<uint8_t> hueMatch;
+    std::vector<double> hueDist;
+    std::vector<double> satDist;
+    std::vector<double> brightDist;
+};
+
+// built from colorGroups on first use, which must not change after that
+static const GroupScoreTables& groupScoreTables()
+{
+    static const GroupScoreTables tables = [] {
+        GroupScoreTables built;
+        size_t n = built.groups = colorGroups.size();
+        built.hueMatch.resize(HSV_HUES * n);
+        built.hueDist.resize(HSV_HUES * n);
+        built.satDist.resize(256 * n);
+        built.brightDist.resize(256 * n);
+        for (size_t g = 0; g < n; g++) {
+            const ColorGroup& group = colorGroups[g];
+            for (int h = 0; h < HSV_HUES; h++) {
+                built.hueMatch[h * n + g] = hueInGroup(h * 2.0, group);
+                built.hueDist[h * n + g] = hueDistance(h * 2.0, group);
+            }
+            for (int i = 0; i < 256; i++) {
+                built.satDist[i * n + g] = rangeDistance(i / 255.0, group.satMin, group.satMax);
+                built.brightDist[i * n + g] = rangeDistance(i / 255.0, group.brightMin, group.brightMax);
+            }
+        }
+        return built;
+    }();
+    return tables;
+}
+
+// the table indices of a color whose properties are exactly those calculateColorProperties gives, false for
+// other colors (Histogram bin centers)
+static bool hsvIndices(const ColorInfo& color, cv::Vec3b& hsv)
+{
+    long h = std::lround(color.hue * 0.5), s = std::lround(color.saturation * 255.0), v = std::lround(color.brightness * 255.0);
+    if (h < 0 || h >= HSV_HUES || s < 0 || s > 255 || v < 0 || v > 255) return false;
+    if (h * 2.0 != color.hue || s / 255.0 != color.saturation || v / 255.0 != color.brightness) return false;
+    hsv = cv::Vec3b(static_cast<uchar>(h), static_cast<uchar>(s), static_cast<uchar>(v));
+    return true;
+}
+
+std::string algorithmHelp()
+{
+    return "KMeans = 0, KMeansOptimized = 1, Histogram = 2, KMeans through OpenCV (reference for 0) = 3, KMeans over a color histogram = 4, Median cut = 5, KMeans with Hamerly bounds = 6, Group vote = 7";
+}
+
+bool parseAlgorithm(int value, ALGORITHM& algorithm)
+{
+    if (value < 0 || value >= ALGORITHM_COUNT) return false;
+    algorithm = static_cast<ALGORITHM>(value);
+    return true;
+}
+
+bool parseSeeding(const std::string& value, KmeansSeeding& seeding)
+{
+    if (value == "pp") { seeding = KmeansSeeding::PLUS_PLUS; }
+    else if (value == "anchors") { seeding = KmeansSeeding::ANCHORS; }
+    else if (value == "peaks") { seeding = KmeansSeeding::PEAKS; }
+    else {
+        return false;
+    }
+    return true;
+}
+
+void printKmeansCounters()
+{
+    KmeansCounters counters = kmeansCounters();
+    if (counters.runs == 0) return;
+
+    std::cout << "k-means: " << counters.runs << " runs, " << std::fixed << std::setprecision(1)
+              << (double)counters.iterations / counters.runs << " iterations on average";
+    if (counters.skipped > 0) {
+        uint64_t plain = counters.distances + counters.skipped;
+        std::cout << ", " << counters.skipped << " of " << plain << " distance computations skipped ("
+                  << 100.0 * counters.skipped / plain << "%)";
+    }
+    std::cout << std::defaultfloat << std::endl;
+}
+
+std::vector<ColorInfo> extractDominantColors(const cv::Mat& image, ALGORITHM algorithm, int k)
+{
+    switch (algorithm) {
+        case KMEANS:    return extractDominantColorsKmeans(image, k);
+        case KMEANSOPT: return extractDominantColorsKmeansOpt(image, k);
+        case HISTOGRAM: return extractDominantColorsHistogram(image, k);
+        case KMEANS_OPENCV: return extractDominantColorsKmeansOpenCV(image, k);
+        case KMEANS_HISTOGRAM: return extractDominantColorsKmeansHistogram(image, k);
+        case MEDIAN_CUT: return extractDominantColorsMedianCut(image, k);
+        case KMEANS_BOUNDED: return extractDominantColorsKmeansBounded(image, k);
+        case GROUP_VOTE: return extractDominantColorsGroupVote(image, k);
+        case ALGORITHM_COUNT: break;
+    }
+    return {};
+}
+
+size_t assignGroup(const std::vector<ColorInfo>& colors, double& bestScore)
+{
+    bestScore = 0.0;
+    size_t bestGroupId = 0;
+
+    std::vector<cv::Vec3b> hsv(colors.size());
+    bool tabled = true;
+    for (size_t c = 0; c < colors.size() && tabled; c++) tabled = hsvIndices(colors[c], hsv[c]);
+
+    std::vector<double> scores(colorGroups.size(), 0.0);
+    if (tabled) {
+        const GroupScoreTables& tables = groupScoreTables();
+        const size_t n = tables.groups;
+        double totalWeight = 0.0;
+        for (size_t c = 0; c < colors.size(); c++) {
+            const uint8_t* hueMatch = &tables.hueMatch[hsv[c][0] * n];
+            const double* hueDist = &tables.hueDist[hsv[c][0] * n];
+            const double* satDist = &tables.satDist[hsv[c][1] * n];
+            const double* brightDist = &tables.brightDist[hsv[c][2] * n];
+            const double weight = colors[c].weight;
+            for (size_t g = 0; g < n; g++) {
+                scores[g] += colorScore(hueMatch[g], hueDist[g], satDist[g], brightDist[g]) * weight;
+            }
+            totalWeight += weight;
+        }
+        for (double& score : scores) score = totalWeight > 0 ? score / totalWeight : 0.0;
+    }
+    else {
+        for (size_t i = 1; i < colorGroups.size(); i++) scores[i] = calculateGroupScore(colors, colorGroups[i]);
+    }
+
+    for (size_t i = 1; i < colorGroups.size(); i++) {
+        double score = scores[i];
+        if (score > bestScore) {
+            bestScore = score;
+            bestGroupId = i;
+        }
+    }
+
+    // If no group has a good score, assign to miscellaneous
+    if (bestScore < 0.3) bestGroupId = 0;
+
+    return bestGroupId;
+}
+
+constexpr int VOTE_BITS = 5; // per channel, GROUP_VOTE bins colors into 2^15 bins
+
+static size_t lookupBin(const cv::Vec3b& p)
+{
+    const int shift = 8 - VOTE_BITS;
+    return ((size_t)(p[0] >> shift) << (2 * VOTE_BITS)) | ((size_t)(p[1] >> shift) << VOTE_BITS) | (p[2] >> shift);
+}
+
+static cv::Vec3b binCenter(size_t bin)
+{
+    const int shift = 8 - VOTE_BITS, half = 1 << (shift - 1), mask = (1 << VOTE_BITS) - 1;
+    return cv::Vec3b(static_cast<uchar>(((bin >> (2 * VOTE_BITS)) << shift) + half),
+                     static_cast<uchar>((((bin >> VOTE_BITS) & mask) << shift) + half),
+                     static_cast<uchar>(((bin & mask) << shift) + half));
+}
+
+// Group of every bin (index b << 10 | g << 5 | r): what assignGroup picks for the center of the bin as the only
+// color of an image. Built from colorGroups on first use, like the score tables.
+static const std::vector<uint16_t>& groupLookup()
+{
+    static const std::vector<uint16_t> lookup = [] {
+        std::vector<uint16_t> built(size_t(1) << (3 * VOTE_BITS));
+        std::vector<ColorInfo> single(1);
+        single[0].weight = 1.0;
+        double score;
+        for (size_t bin = 0; bin < built.size(); bin++) {
+            single[0].color = binCenter(bin);
+            calculateColorProperties(single[0]);
+            built[bin] = static_cast<uint16_t>(assignGroup(single, score));
+        }
+        return built;
+    }();
+    return lookup;
+}
+
+// one color for each of the k groups most pixels vote for through groupLookup, heaviest first; each color looks up
+// to its own group, so assignGroup(GROUP_VOTE) gets the winner back from the colors alone
+std::vector<ColorInfo> extractDominantColorsGroupVote(const cv::Mat& image, int k)
+{
+    const std::vector<uint16_t>& lookup = groupLookup();
+    std::vector<uint32_t> bins(lookup.size(), 0);
+    for (int y = 0; y < image.rows; y++) {
+        const cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < image.cols; x++) bins[lookupBin(row[x])]++;
+    }
+
+    std::vector<uint64_t> votes(colorGroups.size(), 0);
+    std::vector<uint64_t> sums(3 * colorGroups.size(), 0);
+    std::vector<size_t> fullest(colorGroups.size(), SIZE_MAX); // no bin of the group yet
+    std::vector<uint32_t> fullestCount(colorGroups.size(), 0);
+    for (size_t bin = 0; bin < bins.size(); bin++) {
+        if (bins[bin] == 0) continue;
+        uint16_t group = lookup[bin];
+        votes[group] += bins[bin];
+        cv::Vec3b center = binCenter(bin);
+        for (int c = 0; c < 3; c++) sums[3 * group + c] += (uint64_t)bins[bin] * center[c];
+        if (bins[bin] > fullestCount[group]) {
+            fullest[group] = bin;
+            fullestCount[group] = bins[bin];
+        }
+    }
+
+    std::vector<size_t> order;
+    for (size_t g = 0; g < votes.size(); g++) {
+        if (votes[g] > 0) order.push_back(g);
+    }
+    size_t count = std::min(order.size(), static_cast<size_t>(std::max(k, 0)));
+    std::partial_sort(order.begin(), order.begin() + count, order.end(),
+                      [&votes](size_t a, size_t b) { return votes[a] > votes[b] || (votes[a] == votes[b] && a < b); });
+
+    std::vector<ColorInfo> colors;
+    for (size_t i = 0; i < count; i++) {
+        size_t g = order[i];
+        ColorInfo colorInfo;
+        colorInfo.color = cv::Vec3b(static_cast<uchar>((sums[3 * g] + votes[g] / 2) / votes[g]),
+                                    static_cast<uchar>((sums[3 * g + 1] + votes[g] / 2) / votes[g]),
+                                    static_cast<uchar>((sums[3 * g + 2] + votes[g] / 2) / votes[g]));
+        if (lookup[lookupBin(colorInfo.color)] != g) colorInfo.color = binCenter(fullest[g]);
+        colorInfo.weight = (double)votes[g] / image.total();
+        calculateColorProperties(colorInfo);
+        colors.push_back(colorInfo);
+    }
+    return colors;
+}
+
+size_t assignGroup(const std::vector<ColorInfo>& colors, ALGORITHM algorithm, double& bestScore)
+{
+    if (algorithm != GROUP_VOTE) return assignGroup(colors, bestScore);
+    if (colors.empty()) {
+        bestScore = 0.0;
+        return 0;
+    }
+    bestScore = colors[0].weight;
+    return groupLookup()[lookupBin(colors[0].color)];
+}
+
+// box each algorithm fits the image into before analysis
+cv::Size analysisSize(ALGORITHM algorithm)
+{
+    switch (algorithm) {
+        case KMEANSOPT: return cv::Size(150, 150);
+        case KMEANS:
+        case HISTOGRAM:
+        default:        return cv::Size(800, 600);
+    }
+}
+
+// pick the largest JPEG DCT downscale that still covers the analysis box,
+// both orientations are checked because EXIF rotation is applied after decode
+int reducedDecodeFlag(int width, int height, const cv::Size& box)
+{
+    if (width <= 0 || height <= 0) return cv::IMREAD_COLOR;
+
+    double scale = std::max(std::min((double)box.width / width, (double)box.height / height),
+                            std::min((double)box.width / height, (double)box.height / width));
+
+    if (scale <= 1.0 / 8) return cv::IMREAD_REDUCED_COLOR_8;
+    if (scale <= 1.0 / 4) return cv::IMREAD_REDUCED_COLOR_4;
+    if (scale <= 1.0 / 2) return cv::IMREAD_REDUCED_COLOR_2;
+    return cv::IMREAD_COLOR;
+}
+
+cv::Mat fitToBox(const cv::Mat& image, const cv::Size& box)
+{
+    if (image.empty() || (image.cols <= box.width && image.rows <= box.height)) return image;
+
+    cv::Mat fitted;
+    double scale = std::min((double)box.width / image.cols, (double)box.height / image.rows);
+    cv::resize(image, fitted, cv::Size(), scale, scale, cv::INTER_AREA);
+    return fitted;
+}
+
+// file: contents already in memory (pipeline mode), nullptr to load them here
+cv::Mat loadImageScaled(const std::string& path, const FileBuffer* file, const cv::Size& box, bool fullDecode)
+{
+    int flags = cv::IMREAD_COLOR;
+
+    // header probe and decode share one load of the file
+    FileBuffer own;
+    if (file == nullptr && loadMode != LoadMode::IMREAD && own.load(path)) { file = &own; }
+
+    // only JPEG scales inside the decoder, other formats would get resized twice
+    ImageHeader header;
+    if (!fullDecode) {
+        bool probed = file ? probeImageHeader(file->data(), file->size(), header) : probeImageHeader(path, header);
+        if (probed && header.format == ImageFormat::JPEG) flags = reducedDecodeFlag(header.width, header.height, box);
+    }
+
+    return fitToBox(decodeImage(path, file, flags), box);
+}
+
+double computeDarkness(const cv::Mat& img)
+{
+    cv::Mat gray;
+    cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+    cv::Scalar meanVal = cv::mean(gray);
+    double avg_brightness = meanVal[0];
+    return 1.0 - (avg_brightness / 255.0);
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "kmeans.hpp"
+#include "utils.hpp"
+
+// dominant color extraction, color group scoring and darkness, shared by grouper, darkscore and analyze
+
+enum ALGORITHM {
+    KMEANS,
+    KMEANSOPT,
+    HISTOGRAM,
+    KMEANS_OPENCV, // reference: same as KMEANS through cv::kmeans
+    KMEANS_HISTOGRAM, // KMEANS over the occupied bins of a 32³ color histogram
+    MEDIAN_CUT,       // deterministic median cut over the same histogram
+    KMEANS_BOUNDED,   // KMEANS with Hamerly bounds, skips distance computations that cannot change a label
+    GROUP_VOTE,       // every pixel votes for its color group through a lookup table, no clustering
+    ALGORITHM_COUNT
+};
+
+// -a/--algorithm takes the enum value, the help text lists them in that order
+std::string algorithmHelp();
+bool parseAlgorithm(int value, ALGORITHM& algorithm);
+
+// seeding of the k-means based algorithms, --seeding pp|anchors|peaks
+extern KmeansSeeding kmeansSeeding;
+// --pyramid: k-means runs coarse to fine from this longest side, 0 clusters the analysis image directly
+extern int kmeansPyramid;
+constexpr int KMEANS_PYRAMID_SIZE = 32;
+bool parseSeeding(const std::string& value, KmeansSeeding& seeding);
+// runs, average iterations and skipped distances of all k-means calls so far, nothing when there were none
+void printKmeansCounters();
+
+struct ColorInfo {
+    cv::Vec3b color;
+    double weight;
+    double saturation;
+    double brightness;
+    double hue;
+};
+
+// Predefined color groups with representative colors (HSV ranges)
+struct ColorGroup {
+    std::string name;
+    float hueMin, hueMax;
+    float satMin, satMax;
+    float brightMin, brightMax;
+    cv::Vec3b representativeColor;
+};
+
+extern std::vector<ColorGroup> colorGroups;
+
+// Replaces every group but Miscellaneous with the ones in a text file, one per line in the column order of the
+// README table: name hueMin hueMax satMin satMax brightMin brightMax B G R. Blank lines and lines starting with
+// # are skipped. Call before the first assignGroup. On failure colorGroups is unchanged and error names the line.
+bool loadColorGroups(const std::string& path, std::string& error);
+// of every group's name, ranges and representative color, in order: changes whenever colorGroups does
+uint64_t colorGroupsHash();
+
+constexpr int DOMINANT_COLORS = 5;
+
+void calculateColorProperties(ColorInfo& colorInfo);
+std::vector<ColorInfo> extractDominantColorsHistogram(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColorsKmeansOpt(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColorsKmeans(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColorsKmeansOpenCV(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColorsKmeansHistogram(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColorsMedianCut(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColorsKmeansBounded(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColorsGroupVote(const cv::Mat& image, int k = DOMINANT_COLORS);
+std::vector<ColorInfo> extractDominantColors(const cv::Mat& image, ALGORITHM algorithm, int k = DOMINANT_COLORS);
+double calculateGroupScore(const std::vector<ColorInfo>& colors, const ColorGroup& group);
+// index into colorGroups, 0 (Miscellaneous) when no group scores well
+size_t assignGroup(const std::vector<ColorInfo>& colors, double& bestScore);
+// the group of the algorithm's colors: GROUP_VOTE takes the group with the most pixels (the one its heaviest
+// color belongs to) with their share as the score, every other algorithm scores the colors as above
+size_t assignGroup(const std::vector<ColorInfo>& colors, ALGORITHM algorithm, double& bestScore);
+
+cv::Size analysisSize(ALGORITHM algorithm);
+int reducedDecodeFlag(int width, int height, const cv::Size& box);
+cv::Mat fitToBox(const cv::Mat& image, const cv::Size& box);
+cv::Mat loadImageScaled(const std::string& path, const FileBuffer* file, const cv::Size& box, bool fullDecode);
+
+double computeDarkness(const cv::Mat& img);
@@ -0,0 +1,220 @@
+#include <argparse/argparse.hpp>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "analysis.hpp"
+#include "globals.hpp"
+#include "imagecheck.hpp"
+#include "utils.hpp"
+
+// everything validator, darkscore and grouper compute for one image, from a single load and decode
+struct AnalysisResult {
+    std::string filePath;
+    Verdict verdict = Verdict::OK;
+    int width = 0;
+    int height = 0;
+    double darkness = -1.0;
+    size_t groupId = 0;
+    double groupScore = 0.0;
+    std::vector<ColorInfo> dominantColors;
+};
+
+std::vector<AnalysisResult> results;
+
+enum COUNTER {
+    INVALID
+};
+
+AnalysisResult analyzeImage(const std::string& imagePath, const FileBuffer* file, ALGORITHM algorithm, bool checkStructure)
+{
+    AnalysisResult result;
+    result.filePath = imagePath;
+
+    FileBuffer own;
+    if (file == nullptr) {
+        if (own.load(imagePath, loadMode == LoadMode::IMREAD ? LoadMode::AUTO : loadMode)) { file = &own; }
+        else {
+            result.verdict = Verdict::UNREADABLE;
+            return result;
+        }
+    }
+
+    if (checkStructure) {
+        result.verdict = checkImageStructure(file->data(), file->size());
+        if (result.verdict != Verdict::OK) return result;
+    }
+
+    // darkness is a mean over all pixels so it needs the full image, colors are extracted from the shrunk copy
+    cv::Mat image;
+    try {
+        image = decodeImage(imagePath, file);
+    }
+    catch (...) {
+    }
+    if (image.empty()) {
+        result.verdict = file->size() == 0 ? Verdict::ZERO_SIZE : Verdict::DECODE_FAILED;
+        return result;
+    }
+
+    result.width = image.cols;
+    result.height = image.rows;
+    result.darkness = computeDarkness(image);
+
+    cv::Mat small = fitToBox(image, analysisSize(algorithm));
+    image.release();
+
+    result.dominantColors = extractDominantColors(small, algorithm);
+    result.groupId = assignGroup(result.dominantColors, algorithm, result.groupScore);
+
+    return result;
+}
+
+// colors as hex triplets separated by spaces, weight in percent after each
+std::string formatColors(const std::vector<ColorInfo>& colors)
+{
+    std::ostringstream out;
+    for (size_t i = 0; i < colors.size(); i++) {
+        const cv::Vec3b& c = colors[i].color;
+        char hex[8];
+        snprintf(hex, sizeof(hex), "#%02x%02x%02x", c[2], c[1], c[0]);
+        if (i > 0) out << ' ';
+        out << hex << ':' << std::fixed << std::setprecision(1) << colors[i].weight * 100.0;
+    }
+    return out.str();
+}
+
+void processImages(const PathStream& images, ALGORITHM algorithm, bool checkStructure, BatchOptions options)
+{
+    options.counters = 1;
+    options.label = [](const ShardedCounters& counters) {
+        return " (bad: " + std::to_string(counters.sum(INVALID)) + ")";
+    };
+
+    BatchReport report = processBatch(results, images, options, [&images, algorithm, checkStructure](size_t i, BatchContext& ctx) {
+        AnalysisResult result = analyzeImage(images.at(i), ctx.file, algorithm, checkStructure);
+        if (result.verdict != Verdict::OK) { ctx.count(INVALID); }
+        return result;
+    });
+
+    std::cout << "Total files processed: " << results.size() << std::endl;
+    std::cout << "Invalid images: " << report.counters[INVALID] << std::endl;
+    std::cout << "Peak RSS: " << peakRssKb() / 1024 << " MB" << std::endl;
+    printKmeansCounters();
+}
+
+int main(int argc, char* argv[])
+{
+    freopen("/dev/null", "w", stderr); // suppress errors
+
+    argparse::ArgumentParser program("analyze", VERSION);
+    program.add_description("validate, score darkness and find dominant colors/group of images in one pass");
+    program.add_argument("-i", "--input")
+        .required()
+        .help("Path to a image file or folder containing images (recursive), - reads NUL-delimited paths from stdin");
+    program.add_argument("-o", "--output")
+        .required()
+        .help("Path to output CSV file");
+
+    program.add_argument("-a", "--algorithm")
+        .help("dominant color algorithm (" + algorithmHelp() + ")")
+        .metavar("0-" + std::to_string(ALGORITHM_COUNT - 1))
+        .default_value(0)
+        .scan<'i', int>();
+
+    program.add_argument("--seeding")
+        .help("k-means seeding: pp (k-means++, best of 3 runs), anchors (group colors) or peaks (histogram), both one deterministic run")
+        .default_value(std::string("pp"))
+        .metavar("pp|anchors|peaks");
+
+    program.add_argument("--pyramid")
+        .default_value(false)
+        .implicit_value(true)
+        .help("run k-means coarse to fine from a 32px copy, stopping at the first level where the centers settle");
+
+    program.add_argument("--groups")
+        .help("read the color groups from this file instead of the built-in ones (see README)")
+        .default_value(std::string(""))
+        .metavar("groups.txt");
+
+    program.add_argument("-s", "--structure")
+        .default_value(false)
+        .implicit_value(true)
+        .help("check container structure (markers, chunk CRCs, sizes, trailers) before decoding");
+
+    addBatchArguments(program);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::runtime_error& err) {
+        std::cout << err.what() << std::endl;
+        std::cout << program;
+        return 1;
+    }
+
+    ALGORITHM algorithm = KMEANS;
+    if (!parseAlgorithm(program.get<int>("--algorithm"), algorithm)) {
+        std::cout << "Unknown algorithm, expected " << algorithmHelp() << std::endl;
+        return 1;
+    }
+    if (!parseSeeding(program.get<std::string>("--seeding"), kmeansSeeding)) {
+        std::cout << "Unknown seeding, expected pp, anchors or peaks" << std::endl;
+        return 1;
+    }
+    if (program.get<bool>("--pyramid")) { kmeansPyramid = KMEANS_PYRAMID_SIZE; }
+
+    std::string groupsPath = program.get<std::string>("--groups");
+    std::string groupsError;
+    if (!groupsPath.empty() && !loadColorGroups(groupsPath, groupsError)) {
+        std::cout << groupsError << std::endl;
+        return 1;
+    }
+
+    std::string inputPath = program.get<std::string>("--input");
+
+    PathStream images;
+    BatchOptions options = batchOptionsFromArguments(program);
+    processStreamed(images, inputPath, options, [&] { processImages(images, algorithm, program.get<bool>("--structure"), options); });
+    if (images.size() == 0) {
+        std::cout << "No valid images found." << std::endl;
+        return 1;
+    }
+
+    std::string outputPath = program.get<std::string>("--output");
+    std::ofstream out(outputPath);
+    if (!out) {
+        std::cout << "Could not open " << outputPath << std::endl;
+        return 1;
+    }
+
+    out << "image" << CSV_DELIM << "valid" << CSV_DELIM << "verdict" << CSV_DELIM << "width" << CSV_DELIM << "height" << CSV_DELIM
+        << "darkness" << CSV_DELIM << "group" << CSV_DELIM << "score" << CSV_DELIM << "colors\n";
+
+    for (const auto& result : results) {
+        std::error_code ec;
+        std::string abs = std::filesystem::canonical(result.filePath, ec).string();
+        if (ec) abs = result.filePath;
+
+        bool valid = result.verdict == Verdict::OK;
+        out << abs << CSV_DELIM << valid << CSV_DELIM << verdictName(result.verdict) << CSV_DELIM
+            << result.width << CSV_DELIM << result.height << CSV_DELIM;
+        if (valid) {
+            out << result.darkness << CSV_DELIM << colorGroups[result.groupId].name << CSV_DELIM
+                << result.groupScore << CSV_DELIM << formatColors(result.dominantColors);
+        }
+        else {
+            out << CSV_DELIM << CSV_DELIM << CSV_DELIM;
+        }
+        out << "\n";
+    }
+
+    std::cout << "Results written to " << outputPath << std::endl;
+
+    return 0;
+}
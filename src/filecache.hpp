@@ -0,0 +1,279 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "utils.hpp"
+
+// Persistent per-file analysis cache keyed by FileId (dev, inode, size, mtime) with a
+// content hash fallback for renamed/copied files.
+//
+// On disk: header, records sorted by FileId, then record indices sorted by content hash.
+// Loading is two reads, lookups binary search the loaded arrays, nothing is rebuilt.
+// New entries go into sharded maps so worker threads can look up and insert concurrently.
+template <typename T>
+class FileCache {
+    static_assert(std::is_trivially_copyable<T>::value, "cache values are written to disk as raw bytes");
+
+  public:
+    struct Key {
+        FileId id;
+        uint64_t contentHash = 0;
+        bool valid = false;
+        bool hashed = false; // contentHash is set
+    };
+
+    struct Stats {
+        size_t hits = 0;
+        size_t contentHits = 0;
+        size_t misses = 0;
+    };
+
+    explicit FileCache(uint64_t tag = 0) : tag(tag) {}
+
+    bool load(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+
+        Header header;
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!in || std::memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != VERSION_ || header.tag != tag || header.recordSize != sizeof(Record)) {
+            return false;
+        }
+
+        // a truncated or corrupt file is discarded like a missing one: count has to match the bytes that follow
+        std::streamoff start = in.tellg();
+        in.seekg(0, std::ios::end);
+        uint64_t remaining = static_cast<uint64_t>(in.tellg() - start);
+        in.seekg(start);
+        if (header.count > remaining / (sizeof(Record) + sizeof(uint32_t)) ||
+            header.count * (sizeof(Record) + sizeof(uint32_t)) != remaining) {
+            return false;
+        }
+
+        records.resize(header.count);
+        byContentHash.resize(header.count);
+        in.read(reinterpret_cast<char*>(records.data()), header.count * sizeof(Record));
+        in.read(reinterpret_cast<char*>(byContentHash.data()), header.count * sizeof(uint32_t));
+        bool indicesValid = std::all_of(byContentHash.begin(), byContentHash.end(), [&header](uint32_t i) { return i < header.count; });
+        if (!in || !indicesValid) {
+            records.clear();
+            byContentHash.clear();
+            return false;
+        }
+
+        seen.reset(new std::atomic<bool>[records.size()]);
+        for (size_t i = 0; i < records.size(); i++) seen[i].store(false, std::memory_order_relaxed);
+
+        sizes.resize(records.size());
+        for (size_t i = 0; i < records.size(); i++) sizes[i] = records[i].id.size;
+        std::sort(sizes.begin(), sizes.end());
+        return true;
+    }
+
+    // entries of files that were not looked up during this run are dropped
+    bool save(const std::string& path)
+    {
+        std::vector<Record> out;
+        out.reserve(records.size() + inserted());
+
+        for (size_t i = 0; i < records.size(); i++) {
+            if (seen[i].load(std::memory_order_relaxed)) out.push_back(records[i]);
+        }
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto& entry : shard.entries) out.push_back(entry.second);
+        }
+
+        std::stable_sort(out.begin(), out.end(), [](const Record& a, const Record& b) { return a.id < b.id; });
+        out.erase(std::unique(out.begin(), out.end(), [](const Record& a, const Record& b) { return a.id == b.id; }), out.end());
+
+        std::vector<uint32_t> hashIndex(out.size());
+        for (size_t i = 0; i < out.size(); i++) hashIndex[i] = static_cast<uint32_t>(i);
+        std::sort(hashIndex.begin(), hashIndex.end(), [&out](uint32_t a, uint32_t b) { return out[a].contentHash < out[b].contentHash; });
+
+        Header header;
+        std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION_;
+        header.reserved = 0;
+        header.tag = tag;
+        header.recordSize = sizeof(Record);
+        header.count = out.size();
+
+        std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!file) return false;
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(out.data()), out.size() * sizeof(Record));
+            file.write(reinterpret_cast<const char*>(hashIndex.data()), hashIndex.size() * sizeof(uint32_t));
+            if (!file) return false;
+        }
+        return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+
+    // fills key for a later insert() on a miss. The content hash is only computed when the identity misses and a
+    // loaded entry has the same size, so a new file is not read just to find that nothing can match it
+    bool lookup(const std::string& path, Key& key, T& value, const FileBuffer* file = nullptr)
+    {
+        key = Key();
+        if (!getFileId(path, key.id)) {
+            misses++;
+            return false;
+        }
+        key.valid = true;
+
+        if (findLoaded(key.id, value) || findInserted(key.id, value)) {
+            hits++;
+            return true;
+        }
+
+        if (!std::binary_search(sizes.begin(), sizes.end(), key.id.size)) {
+            misses++;
+            return false;
+        }
+
+        hashKey(key, path, file);
+        if (findLoadedByContent(key, value)) {
+            insert(key, value, path); // remember the new identity
+            contentHits++;
+            return true;
+        }
+
+        misses++;
+        return false;
+    }
+
+    // whether lookup() would hit by identity, without reading the file; lets readers skip files already cached
+    bool contains(const std::string& path)
+    {
+        FileId id;
+        if (!getFileId(path, id)) return false;
+
+        auto it = std::lower_bound(records.begin(), records.end(), id, [](const Record& r, const FileId& id) { return r.id < id; });
+        if (it != records.end() && it->id == id) return true;
+
+        Shard& shard = shards[FileIdHash()(id) % SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.entries.count(id) > 0;
+    }
+
+    // file: the contents when the caller has them in memory anyway, otherwise a missing hash reads the file again
+    void insert(Key key, const T& value, const std::string& path, const FileBuffer* file = nullptr)
+    {
+        if (!key.valid) return;
+        hashKey(key, path, file);
+
+        Record record;
+        std::memset(static_cast<void*>(&record), 0, sizeof(record)); // padding goes to disk as well
+        record.id = key.id;
+        record.contentHash = key.contentHash;
+        record.value = value;
+
+        Shard& shard = shards[FileIdHash()(key.id) % SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries[key.id] = record;
+    }
+
+    Stats stats() const { return {hits, contentHits, misses}; }
+    size_t size() const { return records.size(); }
+
+  private:
+    static constexpr char MAGIC[8] = {'W', 'P', 'U', 'C', 'A', 'C', 'H', 'E'};
+    static constexpr uint32_t VERSION_ = 2;
+    static constexpr size_t SHARDS = 64;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved; // 0, keeps tag aligned without padding bytes
+        uint64_t tag;
+        uint64_t recordSize;
+        uint64_t count;
+    };
+
+    struct Record {
+        FileId id;
+        uint64_t contentHash = 0;
+        T value{};
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<FileId, Record, FileIdHash> entries;
+    };
+
+    uint64_t tag;
+    std::vector<Record> records;
+    std::vector<uint32_t> byContentHash;
+    std::vector<uint64_t> sizes; // of the loaded records, sorted
+    std::unique_ptr<std::atomic<bool>[]> seen;
+    std::array<Shard, SHARDS> shards;
+
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> contentHits{0};
+    std::atomic<size_t> misses{0};
+
+    static void hashKey(Key& key, const std::string& path, const FileBuffer* file)
+    {
+        if (key.hashed) return;
+        key.contentHash = file ? hashBytes(file->data(), file->size()) : hashFileContents(path);
+        key.hashed = true;
+    }
+
+    bool findLoaded(const FileId& id, T& value)
+    {
+        auto it = std::lower_bound(records.begin(), records.end(), id, [](const Record& r, const FileId& id) { return r.id < id; });
+        if (it == records.end() || !(it->id == id)) return false;
+
+        seen[it - records.begin()].store(true, std::memory_order_relaxed);
+        value = it->value;
+        return true;
+    }
+
+    bool findInserted(const FileId& id, T& value)
+    {
+        Shard& shard = shards[FileIdHash()(id) % SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(id);
+        if (it == shard.entries.end()) return false;
+
+        value = it->second.value;
+        return true;
+    }
+
+    bool findLoadedByContent(const Key& key, T& value)
+    {
+        auto it = std::lower_bound(byContentHash.begin(), byContentHash.end(), key.contentHash,
+                                   [this](uint32_t i, uint64_t hash) { return records[i].contentHash < hash; });
+
+        for (; it != byContentHash.end() && records[*it].contentHash == key.contentHash; ++it) {
+            if (records[*it].id.size != key.id.size) continue;
+            value = records[*it].value;
+            return true;
+        }
+        return false;
+    }
+
+    size_t inserted()
+    {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.entries.size();
+        }
+        return total;
+    }
+};
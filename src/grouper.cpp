@@ -1,7 +1,7 @@
 #include <algorithm>
 #include <argparse/argparse.hpp>
-#include <atomic>
 #include <csignal>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
@@ -9,525 +9,162 @@
 #include <map>
 #include <mutex>
 #include <opencv2/opencv.hpp>
+#include <set>
 #include <string>
-#include <thread>
 #include <vector>
 
+#include "analysis.hpp"
+#include "filecache.hpp"
 #include "globals.hpp"
 #include "utils.hpp"
 
-enum ALGORITHM {
-    KMEANS,
-    KMEANSOPT,
-    HISTOGRAM
-};
-
 enum ACTION { NONE,
               MOVE,
               COPY };
 
-struct ColorInfo {
-    cv::Vec3b color;
-    double weight;
-    double saturation;
-    double brightness;
-    double hue;
-};
-
 struct ImageInfo {
     std::string path;
     std::string filename;
     std::vector<ColorInfo> dominantColors;
     std::string assignedGroup;
     std::string assignedGroupId;
-    double groupScore;
+    double groupScore = 0.0;
+    bool cached = false; // dominant colors came from the feature cache
 };
 
 std::vector<ImageInfo> images;
 
-// Predefined color groups with representative colors (HSV ranges)
-struct ColorGroup {
-    std::string name;
-    float hueMin, hueMax;
-    float satMin, satMax;
-    float brightMin, brightMax;
-    cv::Vec3b representativeColor;
-    int counter = 0;
+// dominant colors of one image as stored in the feature cache
+struct CachedColors {
+    struct Entry {
+        unsigned char color[3];
+        double weight;
+        double saturation;
+        double brightness;
+        double hue;
+    };
+
+    int count = 0;
+    Entry colors[DOMINANT_COLORS];
 };
 
-std::vector<ColorGroup> colorGroups = {
-    {"Miscellaneous", 0, 0, 0.0f, 0.0f, 0.0f, 0.0f, cv::Vec3b(0, 0, 0)},
-    {"Blue_Cool", 200, 260, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(255, 100, 50)},
-    {"Red_Warm", 340, 20, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(50, 50, 255)},
-    {"Green_Nature", 80, 140, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(50, 255, 100)},
-    {"Orange_Sunset", 20, 50, 0.4f, 1.0f, 0.4f, 1.0f, cv::Vec3b(50, 165, 255)},
-    {"Purple_Mystical", 260, 300, 0.3f, 1.0f, 0.3f, 1.0f, cv::Vec3b(255, 50, 200)},
-    {"Yellow_Bright", 50, 80, 0.4f, 1.0f, 0.5f, 1.0f, cv::Vec3b(50, 255, 255)},
-    {"Pink_Soft", 300, 340, 0.3f, 1.0f, 0.4f, 1.0f, cv::Vec3b(200, 100, 255)},
-    {"Cyan_Tech", 160, 200, 0.4f, 1.0f, 0.4f, 1.0f, cv::Vec3b(255, 200, 100)},
-    {"Dark_Moody", 0, 360, 0.0f, 1.0f, 0.0f, 0.25f, cv::Vec3b(40, 40, 40)},
-    {"Light_Minimal", 0, 360, 0.0f, 0.3f, 0.8f, 1.0f, cv::Vec3b(240, 240, 240)},
-    {"Monochrome", 0, 360, 0.0f, 0.15f, 0.25f, 0.8f, cv::Vec3b(128, 128, 128)},
-    {"Earth_Tones", 25, 45, 0.2f, 0.7f, 0.3f, 0.7f, cv::Vec3b(100, 150, 200)}};
+// bump when an extraction algorithm changes so old caches are discarded
+constexpr uint32_t FEATURE_CACHE_VERSION = 3;
+
+FileCache<CachedColors>* featureCache = nullptr;
 
 std::mutex coutMutex;
-std::mutex processMutex;
 
-void calculateColorProperties(ColorInfo& colorInfo)
+// returns the index of the assigned group in colorGroups
+size_t assignImageToGroup(ImageInfo& imageInfo, ALGORITHM algorithm)
 {
-    cv::Mat bgrPixel(1, 1, CV_8UC3, cv::Scalar(colorInfo.color[0], colorInfo.color[1], colorInfo.color[2]));
-    cv::Mat hsvPixel;
-    cv::cvtColor(bgrPixel, hsvPixel, cv::COLOR_BGR2HSV);
-
-    cv::Vec3b hsv = hsvPixel.at<cv::Vec3b>(0, 0);
-    colorInfo.hue = hsv[0] * 2.0;
-    colorInfo.saturation = hsv[1] / 255.0;
-    colorInfo.brightness = hsv[2] / 255.0;
+    size_t groupId = assignGroup(imageInfo.dominantColors, algorithm, imageInfo.groupScore);
+    imageInfo.assignedGroupId = std::to_string(groupId);
+    imageInfo.assignedGroup = colorGroups[groupId].name;
+    return groupId;
 }
 
-std::vector<ColorInfo> extractDominantColorsHistogram(const cv::Mat& image, int k = 5)
+// the group definitions only change the colors of GROUP_VOTE and of anchors seeding, their hash goes into the
+// upper half then, so editing --groups doesn't discard the caches of the other settings
+uint64_t featureCacheTag(ALGORITHM algorithm, bool fullDecode)
 {
-    cv::Mat hsv;
-    cv::cvtColor(image, hsv, cv::COLOR_BGR2HSV);
-
-    // Create histogram
-    int hbins = 36, sbins = 16, vbins = 16; // Reasonable resolution
-    int histSize[] = {hbins, sbins, vbins};
-    float hranges[] = {0, 180};
-    float sranges[] = {0, 256};
-    float vranges[] = {0, 256};
-    const float* ranges[] = {hranges, sranges, vranges};
-    int channels[] = {0, 1, 2};
-
-    cv::Mat hist;
-    cv::calcHist(&hsv, 1, channels, cv::Mat(), hist, 3, histSize, ranges);
-
-    // Find dominant colors by finding histogram peaks
-    std::vector<ColorInfo> colors;
-    std::vector<std::tuple<int, int, int, float>> peaks;
-
-    // Extract all non-zero histogram bins
-    for (int h = 0; h < hbins; h++) {
-        for (int s = 0; s < sbins; s++) {
-            for (int v = 0; v < vbins; v++) {
-                float count = hist.at<float>(h, s, v);
-                if (count > 0) {
-                    peaks.emplace_back(h, s, v, count);
-                }
-            }
-        }
-    }
-
-    // Sort by count (descending)
-    std::sort(peaks.begin(), peaks.end(),
-              [](const auto& a, const auto& b) {
-                  return std::get<3>(a) > std::get<3>(b);
-              });
-
-    // Take top k peaks
-    int totalPixels = image.rows * image.cols;
-    int numColors = std::min(k, static_cast<int>(peaks.size()));
-
-    for (int i = 0; i < numColors; i++) {
-        auto [h_idx, s_idx, v_idx, count] = peaks[i];
-
-        // Convert histogram indices back to HSV values
-        float hue = (h_idx + 0.5f) * 180.0f / hbins;
-        float sat = (s_idx + 0.5f) * 256.0f / sbins;
-        float val = (v_idx + 0.5f) * 256.0f / vbins;
-
-        // Convert HSV to BGR
-        cv::Mat hsvPixel(1, 1, CV_32FC3, cv::Scalar(hue, sat, val));
-        cv::Mat bgrPixel;
-        cv::cvtColor(hsvPixel, bgrPixel, cv::COLOR_HSV2BGR);
-
-        cv::Vec3f bgr = bgrPixel.at<cv::Vec3f>(0, 0);
-
-        ColorInfo colorInfo;
-        colorInfo.color = cv::Vec3b(
-            static_cast<uchar>(std::clamp(bgr[0], 0.0f, 255.0f)),
-            static_cast<uchar>(std::clamp(bgr[1], 0.0f, 255.0f)),
-            static_cast<uchar>(std::clamp(bgr[2], 0.0f, 255.0f)));
-        colorInfo.weight = count / totalPixels;
-        colorInfo.hue = hue * 2.0; // Convert to 0-360 range
-        colorInfo.saturation = sat / 255.0;
-        colorInfo.brightness = val / 255.0;
-
-        colors.push_back(colorInfo);
-    }
-
-    return colors;
+    uint64_t groups = algorithm == GROUP_VOTE || kmeansSeeding == KmeansSeeding::ANCHORS ? colorGroupsHash() & 0xFFFFFFFF : 0;
+    return groups << 32 | (FEATURE_CACHE_VERSION << 16) | (algorithm << 12) | ((kmeansPyramid > 0) << 11) | ((uint32_t)kmeansSeeding << 9) | (fullDecode << 8) | DOMINANT_COLORS;
 }
 
-std::vector<ColorInfo> extractDominantColorsKmeansOpt(const cv::Mat& image, int k = 5)
-{
-    // Reduce image size for faster processing
-    cv::Mat smallImage;
-    int maxDim = 150; // Much smaller than 800x600
-    if (image.rows > maxDim || image.cols > maxDim) {
-        double scale = std::min((double)maxDim / image.rows, (double)maxDim / image.cols);
-        cv::resize(image, smallImage, cv::Size(), scale, scale);
-    }
-    else {
-        smallImage = image;
-    }
-
-    // Direct conversion to float data without reshaping
-    int totalPixels = smallImage.rows * smallImage.cols;
-    cv::Mat data(totalPixels, 3, CV_32F);
-
-    // Manually copy pixel data to avoid reshape overhead
-    const cv::Vec3b* srcPtr = smallImage.ptr<cv::Vec3b>();
-    float* dstPtr = data.ptr<float>();
-
-    for (int i = 0; i < totalPixels; i++) {
-        dstPtr[i * 3 + 0] = srcPtr[i][0]; // B
-        dstPtr[i * 3 + 1] = srcPtr[i][1]; // G
-        dstPtr[i * 3 + 2] = srcPtr[i][2]; // R
-    }
-
-    cv::Mat labels, centers;
-    cv::kmeans(data, k, labels,
-               cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 10, 1.0), // Reduced iterations
-               1, cv::KMEANS_PP_CENTERS, centers);                                         // Reduced attempts
-
-    std::vector<int> counts(k, 0);
-    for (int i = 0; i < labels.rows; i++) {
-        counts[labels.at<int>(i)]++;
-    }
-
-    std::vector<ColorInfo> colors;
-
-    for (int i = 0; i < k; i++) {
-        ColorInfo colorInfo;
-        colorInfo.color = cv::Vec3b(
-            static_cast<uchar>(std::clamp(centers.at<float>(i, 0), 0.0f, 255.0f)),
-            static_cast<uchar>(std::clamp(centers.at<float>(i, 1), 0.0f, 255.0f)),
-            static_cast<uchar>(std::clamp(centers.at<float>(i, 2), 0.0f, 255.0f)));
-        colorInfo.weight = (double)counts[i] / totalPixels;
-        calculateColorProperties(colorInfo);
-        colors.push_back(colorInfo);
-    }
-
-    std::sort(colors.begin(), colors.end(),
-              [](const ColorInfo& a, const ColorInfo& b) {
-                  return a.weight > b.weight;
-              });
-
-    return colors;
-}
-std::vector<ColorInfo> extractDominantColorsKmeans(const cv::Mat& image, int k = 5)
+CachedColors toCachedColors(const std::vector<ColorInfo>& colors)
 {
-    cv::Mat data = image.reshape(1, image.rows * image.cols);
-    data.convertTo(data, CV_32F);
-
-    cv::Mat labels, centers;
-    cv::kmeans(data, k, labels,
-               cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20, 1.0),
-               3, cv::KMEANS_PP_CENTERS, centers);
-
-    std::vector<int> counts(k, 0);
-    for (int i = 0; i < labels.rows; i++) {
-        counts[labels.at<int>(i)]++;
+    // written to disk as raw bytes: zero the padding after color[3] and after count too
+    CachedColors cached;
+    std::memset(static_cast<void*>(&cached), 0, sizeof(cached));
+    cached.count = std::min((int)colors.size(), DOMINANT_COLORS);
+    for (int i = 0; i < cached.count; i++) {
+        auto& entry = cached.colors[i];
+        for (int c = 0; c < 3; c++) entry.color[c] = colors[i].color[c];
+        entry.weight = colors[i].weight;
+        entry.saturation = colors[i].saturation;
+        entry.brightness = colors[i].brightness;
+        entry.hue = colors[i].hue;
     }
-
-    std::vector<ColorInfo> colors;
-    int totalPixels = image.rows * image.cols;
-
-    for (int i = 0; i < k; i++) {
-        ColorInfo colorInfo;
-        colorInfo.color = cv::Vec3b(
-            static_cast<uchar>(centers.at<float>(i, 0)),
-            static_cast<uchar>(centers.at<float>(i, 1)),
-            static_cast<uchar>(centers.at<float>(i, 2)));
-        colorInfo.weight = (double)counts[i] / totalPixels;
-        calculateColorProperties(colorInfo);
-        colors.push_back(colorInfo);
-    }
-
-    std::sort(colors.begin(), colors.end(),
-              [](const ColorInfo& a, const ColorInfo& b) {
-                  return a.weight > b.weight;
-              });
-
-    return colors;
+    return cached;
 }
 
-double calculateGroupScore(const std::vector<ColorInfo>& colors, const ColorGroup& group)
+std::vector<ColorInfo> fromCachedColors(const CachedColors& cached)
 {
-    double score = 0.0;
-    double totalWeight = 0.0;
-
-    for (const auto& color : colors) {
-        double colorScore = 0.0;
-
-        // Check hue match (handle wraparound for red)
-        bool hueMatch = false;
-        if (group.hueMin > group.hueMax) { // wraparound case (red)
-            hueMatch = (color.hue >= group.hueMin || color.hue <= group.hueMax);
-        }
-        else {
-            hueMatch = (color.hue >= group.hueMin && color.hue <= group.hueMax);
-        }
-
-        if (hueMatch &&
-            color.saturation >= group.satMin && color.saturation <= group.satMax &&
-            color.brightness >= group.brightMin && color.brightness <= group.brightMax) {
-            colorScore = 1.0;
-        }
-        else {
-            // Partial scoring for near matches
-            double hueDist = 0.0;
-            if (group.hueMin > group.hueMax) {
-                hueDist = std::min({std::abs(color.hue - group.hueMin),
-                                    std::abs(color.hue - group.hueMax),
-                                    std::abs(color.hue - (group.hueMin - 360)),
-                                    std::abs(color.hue - (group.hueMax + 360))}) /
-                          180.0;
-            }
-            else {
-                hueDist = std::min(std::abs(color.hue - group.hueMin),
-                                   std::abs(color.hue - group.hueMax)) /
-                          180.0;
-            }
-
-            double satDist = std::max(0.0, std::max(group.satMin - color.saturation,
-                                                    color.saturation - group.satMax));
-            double brightDist = std::max(0.0, std::max(group.brightMin - color.brightness,
-                                                       color.brightness - group.brightMax));
-
-            colorScore = std::max(0.0, 1.0 - (hueDist + satDist + brightDist) / 3.0);
-        }
-
-        score += colorScore * color.weight;
-        totalWeight += color.weight;
-    }
-
-    return totalWeight > 0 ? score / totalWeight : 0.0;
-}
-
-void assignImageToGroup(ImageInfo& imageInfo)
-{
-    double bestScore = 0.0;
-    int bestGroupId = 0;
-    std::string bestGroupName = colorGroups[bestGroupId].name;
-
-    for (size_t i = 1; i < colorGroups.size(); i++) {
-        double score = calculateGroupScore(imageInfo.dominantColors, colorGroups[i]);
-        if (score > bestScore) {
-            bestScore = score;
-            bestGroupId = i;
-            bestGroupName = colorGroups[i].name;
-        }
-    }
-
-    imageInfo.assignedGroupId = bestGroupId;
-    imageInfo.assignedGroup = bestGroupName;
-    imageInfo.groupScore = bestScore;
-
-    // If no group has a good score, assign to miscellaneous
-    if (bestScore < 0.3) {
-        bestGroupId = 0;
-        imageInfo.assignedGroupId = bestGroupId;
-        imageInfo.assignedGroup = colorGroups[bestGroupId].name;
-    }
-
-    {
-        colorGroups[bestGroupId].counter++;
-        std::lock_guard<std::mutex> lock(processMutex);
+    std::vector<ColorInfo> colors(cached.count);
+    for (int i = 0; i < cached.count; i++) {
+        const auto& entry = cached.colors[i];
+        colors[i].color = cv::Vec3b(entry.color[0], entry.color[1], entry.color[2]);
+        colors[i].weight = entry.weight;
+        colors[i].saturation = entry.saturation;
+        colors[i].brightness = entry.brightness;
+        colors[i].hue = entry.hue;
     }
+    return colors;
 }
 
-size_t scanFolderMakeStructs(const std::string& folderPath)
+void processImages(const std::string& inputFolder, ALGORITHM algorithm, bool fullDecode, BatchOptions options)
 {
-    std::cout << "Scanning folder: " << folderPath << std::endl;
-
-    if (!std::filesystem::exists(folderPath)) {
-        std::cerr << "Error scanning folder: " << folderPath << std::endl;
-        return 0;
-    }
-
-    try {
-        size_t files = 0;
-        for (const auto& entry : std::filesystem::recursive_directory_iterator(folderPath)) {
-            if (entry.is_regular_file() && isSupportedFormat(entry.path().filename().string())) {
-                files++;
-            }
-        }
-        images.reserve(files);
-
-        for (const auto& entry : std::filesystem::recursive_directory_iterator(folderPath)) {
-            if (entry.is_regular_file() && isSupportedFormat(entry.path().filename().string())) {
-                ImageInfo imgInfo;
-                imgInfo.path = entry.path().string();
-                imgInfo.filename = entry.path().filename().string();
-                images.push_back(imgInfo);
-            }
+    cv::Size box = analysisSize(algorithm);
+    if (featureCache) { options.needed = [](const std::string& path) { return !featureCache->contains(path); }; }
+
+    // one counter per color group, redrawn above the progress line
+    options.counters = colorGroups.size();
+    options.table = [](std::ostream& out, const ShardedCounters& counters) {
+        for (size_t i = 0; i < colorGroups.size(); i++) {
+            out << colorGroups[i].name << "\t:\t" << counters.sum(i) << std::endl;
         }
-    }
-    catch (const std::filesystem::filesystem_error& ex) {
-        std::cerr << "Error scanning folder: " << ex.what() << std::endl;
-        return 0;
-    }
-
-    int totalCount = images.size();
-    std::cout << "Found " << totalCount << " image files." << std::endl;
-
-    if (totalCount == 0) {
-        std::cout << "No images found." << std::endl;
-    }
-
-    return totalCount;
-}
-
-void processImages(const std::string& inputFolder, ALGORITHM algorithm)
-{
-    auto startTime = std::chrono::high_resolution_clock::now();
-
-    size_t count = scanFolderMakeStructs(inputFolder);
-    if (!(count > 0)) { exit(1); }
-
-    int numThreads = std::thread::hardware_concurrency();
-    if (numThreads == 0) numThreads = 4; // Fallback in case detection fails
-
-    std::cout << "Using " << numThreads << " threads for processing." << std::endl;
-
-    size_t totalImages = images.size();
-    size_t chunkSize = (totalImages + numThreads - 1) / numThreads;
-    std::atomic<int> processedImages{0};
-
-    std::vector<std::thread> threads;
-    threads.reserve(numThreads);
-    std::atomic<bool> running = true;
-
-    Cursor::hide();
-    Cursor::termClear();
-
-    std::thread printThread([&running, &processedImages, &totalImages]() {
-        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
-        std::chrono::steady_clock::time_point prev_time = start_time;
-        size_t prev_processed = 0;
-
-        // Moving average for i/s calculation
-        std::vector<double> speed_samples;
-        const size_t max_samples = 10; // Average over last 10 samples
-        float top_speed = 0.0f;
-
-        while (running) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            {
-                std::lock_guard<std::mutex> lock(coutMutex);
-                Cursor::reset();
-
-                for (size_t i = 0; i < colorGroups.size(); i++) {
-                    std::cout << colorGroups[i].name << "\t:\t" << colorGroups[i].counter << std::endl;
-                }
-
-                size_t current = processedImages;
-                auto now = std::chrono::steady_clock::now();
-                std::chrono::duration<double> elapsed_time = now - start_time;
-                std::chrono::duration<double> time_delta = now - prev_time;
-
-                // Calculate instantaneous speed
-                double instant_speed = 0.0;
-                if (time_delta.count() > 0) {
-                    instant_speed = (current - prev_processed) / time_delta.count();
-                }
-
-                // Add to moving average (only if we processed some images)
-                if (current > prev_processed) {
-                    speed_samples.push_back(instant_speed);
-                    if (speed_samples.size() > max_samples) {
-                        speed_samples.erase(speed_samples.begin());
-                    }
-                }
-
-                // Calculate averaged speed
-                double avg_speed = 0.0;
-                if (!speed_samples.empty()) {
-                    double sum = 0.0;
-                    for (double speed : speed_samples) {
-                        sum += speed;
-                    }
-                    avg_speed = sum / speed_samples.size();
-                }
-
-                prev_time = now;
-                prev_processed = current;
-
-                std::cout << std::endl;
-                float p = static_cast<float>(current) / static_cast<float>(totalImages);
-
-                // Calculate ETA
-                std::string eta_str = "";
-                if (avg_speed > 0 && current < totalImages) {
-                    double remaining_time = (totalImages - current) / avg_speed;
-                    int eta_minutes = static_cast<int>(remaining_time / 60);
-                    int eta_seconds = static_cast<int>(remaining_time) % 60;
-                    eta_str = " ETA: " + std::to_string(eta_minutes) + "m " + std::to_string(eta_seconds) + "s";
-                }
-
-                if (avg_speed > top_speed) top_speed = avg_speed;
+    };
 
-                std::cout << "==: " << current << "/" << totalImages << "  "
-                          << std::fixed << std::setprecision(1)
-                          << p * 100 << "% (avg: " << std::setprecision(1) << avg_speed << " i/s)" << " (top: " << top_speed << " i/s)"
-                          << eta_str << "               " << std::endl;
+    PathStream paths;
+    processStreamed(paths, inputFolder, options, [&] {
+        processBatch(images, paths, options, [&paths, &algorithm, &box, fullDecode](size_t i, BatchContext& ctx) {
+            ImageInfo imageInfo;
+            imageInfo.path = paths.at(i);
+            imageInfo.filename = std::filesystem::path(imageInfo.path).filename().string();
+
+            FileCache<CachedColors>::Key key;
+            CachedColors cached;
+            if (featureCache && featureCache->lookup(imageInfo.path, key, cached, ctx.file)) {
+                imageInfo.dominantColors = fromCachedColors(cached);
+                imageInfo.cached = true;
+                ctx.count(assignImageToGroup(imageInfo, algorithm));
+                return imageInfo;
             }
-        }
-        std::cout << std::endl;
-    });
 
-    auto processImageThread = [&processedImages, &algorithm](size_t start, size_t end, int threadId) {
-        for (size_t i = start; i < end; ++i) {
-            auto& imageInfo = images[i];
+            // a miss loads the file once for both the decode and the content hash of the new entry
+            FileBuffer own;
+            const FileBuffer* file = ctx.file;
+            if (featureCache && file == nullptr && loadMode != LoadMode::IMREAD && own.load(imageInfo.path)) { file = &own; }
 
-            cv::Mat image = cv::imread(imageInfo.path);
+            cv::Mat image = loadImageScaled(imageInfo.path, file, box, fullDecode);
             if (image.empty()) {
                 std::lock_guard<std::mutex> lock(coutMutex);
-                std::cerr << "[Thread " << threadId << "] Could not load: " << imageInfo.path << std::endl;
-                continue;
-            }
-
-            if (image.cols > 800 || image.rows > 600) {
-                double scale = std::min(800.0 / image.cols, 600.0 / image.rows);
-                cv::resize(image, image, cv::Size(), scale, scale);
-            }
-
-            switch (algorithm) {
-                case KMEANS:    imageInfo.dominantColors = extractDominantColorsKmeans(image); break;
-                case KMEANSOPT: imageInfo.dominantColors = extractDominantColorsKmeansOpt(image); break;
-                case HISTOGRAM: imageInfo.dominantColors = extractDominantColorsHistogram(image); break;
+                std::cerr << "[Thread " << ctx.threadId << "] Could not load: " << imageInfo.path << std::endl;
+                return imageInfo;
             }
 
-            assignImageToGroup(imageInfo);
-            processedImages++;
-        }
-    };
+            imageInfo.dominantColors = extractDominantColors(image, algorithm);
 
-    for (int t = 0; t < numThreads; ++t) {
-        size_t start = t * chunkSize;
-        size_t end = std::min(start + chunkSize, totalImages);
-        if (start >= totalImages) break;
-        threads.emplace_back(processImageThread, start, end, t);
-    }
+            if (featureCache) { featureCache->insert(key, toCachedColors(imageInfo.dominantColors), imageInfo.path, file); }
 
-    for (auto& thread : threads) {
-        if (thread.joinable()) {
-            thread.join();
-        }
+            ctx.count(assignImageToGroup(imageInfo, algorithm));
+            return imageInfo;
+        });
+    });
+    if (images.empty()) {
+        std::cout << "No images found." << std::endl;
+        exit(1);
     }
 
-    // stop print thread
-    running = false;
-    printThread.join();
-
-    auto endTime = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+    std::cout << "Peak RSS: " << peakRssKb() / 1024 << "MB" << std::endl;
+    printKmeansCounters();
 
-    std::cout << "\nCompleted in " << duration.count() << "ms" << std::endl;
-    std::cout << "Average: " << std::fixed << std::setprecision(2)
-              << (double)duration.count() / images.size() << "ms per image" << std::endl;
+    if (featureCache) {
+        auto stats = featureCache->stats();
+        std::cout << "Feature cache: " << stats.hits + stats.contentHits << " hits (" << stats.contentHits << " by content hash), "
+                  << stats.misses << " misses" << std::endl;
+    }
 }
 
 void createGroupFoldersMoveOrCopyFiles(const std::string& outputPath, ACTION action)
@@ -544,6 +181,22 @@ void createGroupFoldersMoveOrCopyFiles(const std::string& outputPath, ACTION act
             }
         }
 
+        // file names already in the output tree and the group folders holding them, from earlier runs
+        std::map<std::string, std::vector<std::string>> placed;
+        std::error_code ec;
+        for (const auto& folder : std::filesystem::directory_iterator(outputPath, ec)) {
+            if (!folder.is_directory(ec)) continue;
+            for (const auto& file : std::filesystem::directory_iterator(folder.path(), ec)) {
+                placed[file.path().filename().string()].push_back(folder.path().filename().string());
+            }
+        }
+
+        // group/file of every image this run places: an image sharing another one's name never removes its copy
+        std::set<std::string> destinations;
+        for (const auto& group : groupedImages) {
+            for (const auto& image : group.second) destinations.insert(group.first + "/" + image->filename);
+        }
+
         // Create folders and copy/move images
         for (const auto& group : groupedImages) {
             std::string groupPath = outputPath + "/" + group.first;
@@ -552,9 +205,41 @@ void createGroupFoldersMoveOrCopyFiles(const std::string& outputPath, ACTION act
             std::cout << "\n"
                       << group.first << " (" << group.second.size() << " images):" << std::endl;
 
+            size_t unchanged = 0;
             for (const auto& image : group.second) {
                 std::string destPath = groupPath + "/" + image->filename;
 
+                // A copy of this image (same name and size) from an earlier run counts only in this group's
+                // folder. A file in another group folder is left from an assignment that changed since (e.g.
+                // through --groups) and is removed when copying, but only when no image of this run goes there
+                // and its contents hash the same as this image's.
+                bool inPlace = false;
+                auto previous = placed.find(image->filename);
+                if (previous != placed.end()) {
+                    std::error_code sourceError;
+                    uintmax_t size = std::filesystem::file_size(image->path, sourceError);
+                    uint64_t sourceHash = 0;
+                    for (const auto& folder : previous->second) {
+                        std::string copyPath = outputPath + "/" + folder + "/" + image->filename;
+                        if (sourceError || std::filesystem::file_size(copyPath, ec) != size || ec) continue;
+                        if (folder == group.first) {
+                            inPlace = true;
+                            continue;
+                        }
+                        if (action != COPY || destinations.count(folder + "/" + image->filename)) continue;
+                        if (sourceHash == 0) { sourceHash = hashFileContents(image->path); }
+                        if (sourceHash != 0 && hashFileContents(copyPath) == sourceHash && std::filesystem::remove(copyPath, ec)) {
+                            std::cout << "  Removed stale copy: " << folder << "/" << image->filename << std::endl;
+                        }
+                    }
+                }
+
+                // incremental run: cached images were placed by a previous run
+                if (image->cached && inPlace) {
+                    unchanged++;
+                    continue;
+                }
+
                 switch (action) {
                     case NONE: break;
                     case COPY:
@@ -583,6 +268,8 @@ void createGroupFoldersMoveOrCopyFiles(const std::string& outputPath, ACTION act
                         }
                 }
             }
+
+            if (unchanged > 0) { std::cout << "  Unchanged: " << unchanged << " already in place" << std::endl; }
         }
     }
     catch (const std::filesystem::filesystem_error& ex) {
@@ -656,7 +343,7 @@ int main(int argc, char* argv[])
     program.add_description("group wallpapers by color palette");
     auto& options_required = program.add_group("Required");
     options_required.add_argument("-i", "--input")
-        .help("input folder")
+        .help("input folder, - reads NUL-delimited paths from stdin")
         .required();
     program.add_argument("-r", "--report")
         .help("save report in a txt file")
@@ -675,10 +362,31 @@ int main(int argc, char* argv[])
         .default_value(false)
         .implicit_value(true);
     options_optional.add_argument("-a", "--algorithm")
-        .help("which algorithm to use when grouping images (KMeans = 0, KMeansOptimized = 1, Histogram = 2")
-        .metavar("0/1/2")
+        .help("which algorithm to use when grouping images (" + algorithmHelp() + ")")
+        .metavar("0-" + std::to_string(ALGORITHM_COUNT - 1))
         .default_value(0)
         .scan<'i', int>();
+    options_optional.add_argument("--seeding")
+        .help("k-means seeding: pp (k-means++, best of 3 runs), anchors (group colors) or peaks (histogram), both one deterministic run")
+        .default_value(std::string("pp"))
+        .metavar("pp|anchors|peaks");
+    options_optional.add_argument("--pyramid")
+        .help("run k-means coarse to fine from a 32px copy, stopping at the first level where the centers settle")
+        .default_value(false)
+        .implicit_value(true);
+    options_optional.add_argument("-f", "--full-decode")
+        .help("decode images at full resolution instead of letting the JPEG decoder downscale")
+        .default_value(false)
+        .implicit_value(true);
+    options_optional.add_argument("--groups")
+        .help("read the color groups from this file instead of the built-in ones (see README)")
+        .default_value(std::string(""))
+        .metavar("groups.txt");
+    options_optional.add_argument("--cache")
+        .help("reuse dominant colors of unchanged files from this cache file and update it (per algorithm)")
+        .default_value(std::string(""))
+        .metavar("cache.bin");
+    addBatchArguments(program);
 
     // HANDLE CTRL+C
     struct sigaction sigIntHandler;
@@ -702,15 +410,38 @@ int main(int argc, char* argv[])
     }
 
     ALGORITHM algorithm = KMEANS;
-    switch (program.get<int>("algorithm")) {
-        case 0: algorithm = KMEANS; break;
-        case 1: algorithm = KMEANSOPT; break;
-        case 2: algorithm = HISTOGRAM; break;
+    if (!parseAlgorithm(program.get<int>("algorithm"), algorithm)) {
+        std::cout << "Unknown algorithm, expected " << algorithmHelp() << std::endl;
+        return 1;
+    }
+    if (!parseSeeding(program.get<std::string>("seeding"), kmeansSeeding)) {
+        std::cout << "Unknown seeding, expected pp, anchors or peaks" << std::endl;
+        return 1;
+    }
+    if (program.get<bool>("pyramid")) { kmeansPyramid = KMEANS_PYRAMID_SIZE; }
+
+    std::string groupsPath = program.get<std::string>("groups");
+    std::string groupsError;
+    if (!groupsPath.empty() && !loadColorGroups(groupsPath, groupsError)) {
+        std::cout << groupsError << std::endl;
+        return 1;
     }
 
     std::string inputFolder = program.get<std::string>("input");
+    bool fullDecode = program.get<bool>("full-decode");
 
-    processImages(inputFolder, algorithm);
+    std::string cachePath = program.get<std::string>("cache");
+    FileCache<CachedColors> cache(featureCacheTag(algorithm, fullDecode));
+    if (!cachePath.empty()) {
+        if (cache.load(cachePath)) { std::cout << "Loaded " << cache.size() << " feature cache entries." << std::endl; }
+        featureCache = &cache;
+    }
+
+    processImages(inputFolder, algorithm, fullDecode, batchOptionsFromArguments(program));
+
+    if (featureCache && !cache.save(cachePath)) {
+        std::cout << "Warning: could not write feature cache " << cachePath << std::endl;
+    }
 
     // Show summary
     printSummary();
@@ -0,0 +1,229 @@
+#include "imagecheck.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "utils.hpp"
+
+const char* verdictName(Verdict verdict)
+{
+    switch (verdict) {
+        case Verdict::OK:            return "ok";
+        case Verdict::ZERO_SIZE:     return "zero-size";
+        case Verdict::UNREADABLE:    return "unreadable";
+        case Verdict::BAD_HEADER:    return "bad header";
+        case Verdict::TRUNCATED:     return "truncated";
+        case Verdict::CORRUPT:       return "corrupt structure";
+        case Verdict::BAD_CHECKSUM:  return "bad checksum";
+        case Verdict::DECODE_FAILED: return "decode failed";
+    }
+    return "unknown";
+}
+
+static uint32_t crc32(const unsigned char* data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// SOI, marker segments, entropy-coded scans (possibly several for progressive) up to EOI
+static Verdict checkJpeg(const unsigned char* data, size_t size)
+{
+    bool sawFrame = false;
+    size_t pos = 2;
+
+    while (true) {
+        if (pos >= size) return Verdict::TRUNCATED;
+        if (data[pos] != 0xFF) return Verdict::CORRUPT;
+        while (pos < size && data[pos] == 0xFF) pos++; // fill bytes
+        if (pos >= size) return Verdict::TRUNCATED;
+
+        unsigned char marker = data[pos++];
+        if (marker == 0xD9) return sawFrame ? Verdict::OK : Verdict::CORRUPT;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+        if (marker == 0xD8 || marker == 0x00) return Verdict::CORRUPT;
+
+        if (pos + 2 > size) return Verdict::TRUNCATED;
+        uint16_t length = readBE16(data + pos);
+        if (length < 2) return Verdict::CORRUPT;
+        if (pos + length > size) return Verdict::TRUNCATED;
+
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            sawFrame = true;
+        }
+        pos += length;
+
+        if (marker != 0xDA) continue;
+        if (!sawFrame) return Verdict::CORRUPT;
+
+        // entropy-coded data ends at the first 0xFF that is not stuffing (FF00), a restart marker or a fill byte
+        while (true) {
+            const void* ff = std::memchr(data + pos, 0xFF, size - pos);
+            if (ff == nullptr) return Verdict::TRUNCATED;
+            pos = static_cast<const unsigned char*>(ff) - data;
+            if (pos + 1 >= size) return Verdict::TRUNCATED;
+
+            unsigned char next = data[pos + 1];
+            if (next == 0x00 || (next >= 0xD0 && next <= 0xD7)) {
+                pos += 2;
+                continue;
+            }
+            if (next == 0xFF) {
+                pos++;
+                continue;
+            }
+            break;
+        }
+    }
+}
+
+// chunk walk from IHDR to IEND, verifying every CRC
+static Verdict checkPng(const unsigned char* data, size_t size)
+{
+    size_t pos = 8;
+    bool first = true;
+
+    while (true) {
+        if (pos + 8 > size) return Verdict::TRUNCATED;
+        uint32_t length = readBE32(data + pos);
+        const unsigned char* type = data + pos + 4;
+
+        if (length > 0x7FFFFFFFu) return Verdict::CORRUPT;
+        if (first && std::memcmp(type, "IHDR", 4) != 0) return Verdict::CORRUPT;
+        if (pos + 12 + (uint64_t)length > size) return Verdict::TRUNCATED;
+        if (crc32(type, length + 4) != readBE32(data + pos + 8 + length)) return Verdict::BAD_CHECKSUM;
+        if (std::memcmp(type, "IEND", 4) == 0) return Verdict::OK;
+
+        pos += 12 + (size_t)length;
+        first = false;
+    }
+}
+
+// RIFF size must fit the file and every chunk must fit the RIFF
+static Verdict checkWebp(const unsigned char* data, size_t size)
+{
+    uint64_t end = (uint64_t)readLE32(data + 4) + 8;
+    if (end > size) return Verdict::TRUNCATED;
+    if (end < 20) return Verdict::CORRUPT;
+
+    uint64_t pos = 12;
+    while (pos < end) {
+        if (pos + 8 > end) return Verdict::CORRUPT;
+        uint32_t chunkSize = readLE32(data + pos + 4);
+        pos += 8 + (uint64_t)chunkSize + (chunkSize & 1);
+        if (pos > end + 1) return Verdict::CORRUPT; // tolerate a missing pad byte on the last chunk
+    }
+    return Verdict::OK;
+}
+
+static bool skipGifSubBlocks(const unsigned char* data, size_t size, size_t& pos)
+{
+    while (true) {
+        if (pos >= size) return false;
+        unsigned char length = data[pos++];
+        if (length == 0) return true;
+        pos += length;
+    }
+}
+
+// block walk over image descriptors and extensions up to the trailer
+static Verdict checkGif(const unsigned char* data, size_t size)
+{
+    if (size < 13) return Verdict::TRUNCATED;
+
+    size_t pos = 13;
+    unsigned char flags = data[10];
+    if (flags & 0x80) pos += 3 * (1 << ((flags & 0x07) + 1)); // global color table
+
+    while (true) {
+        if (pos >= size) return Verdict::TRUNCATED;
+        unsigned char block = data[pos++];
+
+        switch (block) {
+            case 0x3B: return Verdict::OK;
+            case 0x21:
+                pos++; // extension label
+                if (!skipGifSubBlocks(data, size, pos)) return Verdict::TRUNCATED;
+                break;
+            case 0x2C:
+                {
+                    if (pos + 9 > size) return Verdict::TRUNCATED;
+                    unsigned char localFlags = data[pos + 8];
+                    pos += 9;
+                    if (localFlags & 0x80) pos += 3 * (1 << ((localFlags & 0x07) + 1)); // local color table
+                    pos++;                                                              // LZW minimum code size
+                    if (!skipGifSubBlocks(data, size, pos)) return Verdict::TRUNCATED;
+                    break;
+                }
+            default: return Verdict::CORRUPT;
+        }
+    }
+}
+
+// uncompressed pixel array must fit behind the pixel data offset
+static Verdict checkBmp(const unsigned char* data, size_t size)
+{
+    if (size < 26) return Verdict::TRUNCATED;
+
+    uint32_t offset = readLE32(data + 10);
+    uint32_t dibSize = readLE32(data + 14);
+    if (offset > size) return Verdict::TRUNCATED;
+    if (dibSize < 40 || size < 34) return Verdict::OK;
+
+    int64_t width = (int32_t)readLE32(data + 18);
+    int64_t height = std::llabs((int32_t)readLE32(data + 22));
+    uint16_t bpp = readLE16(data + 28);
+    uint32_t compression = readLE32(data + 30);
+    if (width <= 0 || height == 0 || bpp == 0) return Verdict::CORRUPT;
+
+    if (compression == 0 || compression == 3) { // BI_RGB / BI_BITFIELDS
+        uint64_t rowSize = ((width * bpp + 31) / 32) * 4;
+        if ((uint64_t)offset + rowSize * height > size) return Verdict::TRUNCATED;
+    }
+    return Verdict::OK;
+}
+
+static Verdict checkTiff(const unsigned char* data, size_t size)
+{
+    if (size < 8) return Verdict::TRUNCATED;
+    bool little = data[0] == 'I';
+    uint32_t ifd = little ? readLE32(data + 4) : readBE32(data + 4);
+    if (ifd < 8 || (uint64_t)ifd + 2 > size) return Verdict::TRUNCATED;
+    return Verdict::OK;
+}
+
+Verdict checkImageStructure(const unsigned char* data, size_t size)
+{
+    if (size == 0) return Verdict::ZERO_SIZE;
+    if (size < 12) return Verdict::BAD_HEADER;
+
+    if (data[0] == 0xFF && data[1] == 0xD8) return checkJpeg(data, size);
+    if (std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) return checkPng(data, size);
+    if (std::memcmp(data, "RIFF", 4) == 0 && std::memcmp(data + 8, "WEBP", 4) == 0) return checkWebp(data, size);
+    if (std::memcmp(data, "GIF87a", 6) == 0 || std::memcmp(data, "GIF89a", 6) == 0) return checkGif(data, size);
+    if (data[0] == 'B' && data[1] == 'M') return checkBmp(data, size);
+    if (std::memcmp(data, "II*\0", 4) == 0 || std::memcmp(data, "MM\0*", 4) == 0) return checkTiff(data, size);
+
+    return Verdict::BAD_HEADER;
+}
+
+Verdict checkImageFile(const std::string& path)
+{
+    FileBuffer file;
+    if (!file.load(path, loadMode == LoadMode::IMREAD ? LoadMode::AUTO : loadMode)) return Verdict::UNREADABLE;
+    return checkImageStructure(file.data(), file.size());
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// result of walking an image container without decoding its pixels
+enum class Verdict {
+    OK,
+    ZERO_SIZE,
+    UNREADABLE,
+    BAD_HEADER,
+    TRUNCATED,
+    CORRUPT,
+    BAD_CHECKSUM,
+    DECODE_FAILED
+};
+
+const char* verdictName(Verdict verdict);
+Verdict checkImageStructure(const unsigned char* data, size_t size);
+Verdict checkImageFile(const std::string& path);
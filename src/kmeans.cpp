@@ -0,0 +1,1070 @@
+#include "kmeans.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <random>
+
+// SIMD kernels when the build enables them; KMEANS_SCALAR keeps the plain C++ ones, `make test` builds both
+// and checks that they give the same results
+#if defined(__AVX2__) && !defined(KMEANS_SCALAR)
+#define KMEANS_AVX2
+#elif defined(__SSE4_1__) && !defined(KMEANS_SCALAR)
+#define KMEANS_SSE41
+#endif
+
+#if defined(KMEANS_AVX2) || defined(KMEANS_SSE41)
+#include <immintrin.h>
+#endif
+
+constexpr int FIXED_BITS = 3; // coordinates in 1/8 units: a pixel is exact, a center is rounded to 1/8
+constexpr int FIXED_ONE = 1 << FIXED_BITS;
+
+// Pixels split into (b, g) and (r, 0) int16 pairs: one madd per pair gives b² + g² and r² as int32 per pixel.
+// Differences stay within ±2040 and a squared distance below 3 * 2040², so int16 inputs and int32 sums never overflow.
+struct PackedPixels {
+    std::vector<int16_t> bg;
+    std::vector<int16_t> r0;
+    std::vector<uint32_t> weights; // pixels behind each point, empty when every point is one pixel
+    size_t n = 0;
+
+    uint32_t weight(size_t i) const { return weights.empty() ? 1 : weights[i]; }
+};
+
+// centers in the same layout, one (b, g) and one (r, 0) pair per center
+struct PackedCenters {
+    int32_t bg[KMEANS_MAX_K];
+    int32_t r0[KMEANS_MAX_K];
+};
+
+static inline void packPixel(PackedPixels& px, size_t i, const cv::Vec3b& p)
+{
+    px.bg[2 * i] = p[0] << FIXED_BITS;
+    px.bg[2 * i + 1] = p[1] << FIXED_BITS;
+    px.r0[2 * i] = p[2] << FIXED_BITS;
+    px.r0[2 * i + 1] = 0;
+}
+
+// rows [y0, y1) into px, reusing its buffers
+static void packRows(const cv::Mat& image, int y0, int y1, PackedPixels& px)
+{
+    px.n = (size_t)(y1 - y0) * image.cols;
+    px.bg.resize(2 * px.n);
+    px.r0.resize(2 * px.n);
+
+    size_t i = 0;
+    for (int y = y0; y < y1; y++) {
+        const cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < image.cols; x++, i++) packPixel(px, i, row[x]);
+    }
+}
+
+static PackedPixels packPixels(const cv::Mat& image)
+{
+    PackedPixels px;
+    packRows(image, 0, image.rows, px);
+    return px;
+}
+
+// n pixels picked uniformly at random (with repetition) into px, reusing its buffers
+static void packSample(const cv::Mat& image, size_t n, std::mt19937_64& rng, PackedPixels& px)
+{
+    px.n = n;
+    px.bg.resize(2 * n);
+    px.r0.resize(2 * n);
+
+    std::uniform_int_distribution<size_t> pick(0, image.total() - 1);
+    for (size_t i = 0; i < n; i++) {
+        size_t at = pick(rng);
+        packPixel(px, i, image.ptr<cv::Vec3b>(at / image.cols)[at % image.cols]);
+    }
+}
+
+// one point per non-empty bin of a histogram with `bits` per channel, placed at the mean of the pixels in
+// the bin (rounded to 1/8) and weighted by their count
+static PackedPixels packHistogram(const cv::Mat& image, int bits)
+{
+    const int shift = 8 - bits;
+    const size_t bins = size_t(1) << (3 * bits);
+    std::vector<uint32_t> count(bins, 0);
+    std::vector<uint64_t> sumB(bins, 0), sumG(bins, 0), sumR(bins, 0);
+
+    for (int y = 0; y < image.rows; y++) {
+        const cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < image.cols; x++) {
+            const cv::Vec3b& p = row[x];
+            size_t bin = ((size_t)(p[0] >> shift) << (2 * bits)) | ((size_t)(p[1] >> shift) << bits) | (p[2] >> shift);
+            count[bin]++;
+            sumB[bin] += p[0];
+            sumG[bin] += p[1];
+            sumR[bin] += p[2];
+        }
+    }
+
+    PackedPixels px;
+    for (size_t bin = 0; bin < bins; bin++) {
+        if (count[bin] == 0) continue;
+        uint64_t n = count[bin];
+        px.bg.push_back(static_cast<int16_t>((sumB[bin] * FIXED_ONE + n / 2) / n));
+        px.bg.push_back(static_cast<int16_t>((sumG[bin] * FIXED_ONE + n / 2) / n));
+        px.r0.push_back(static_cast<int16_t>((sumR[bin] * FIXED_ONE + n / 2) / n));
+        px.r0.push_back(0);
+        px.weights.push_back(count[bin]);
+    }
+    px.n = px.weights.size();
+    return px;
+}
+
+static int16_t toFixed(float v) { return static_cast<int16_t>(std::lround(std::clamp(v, 0.0f, 255.0f) * FIXED_ONE)); }
+
+static PackedCenters packCenters(const std::vector<cv::Vec3f>& centers)
+{
+    PackedCenters packed;
+    for (size_t c = 0; c < centers.size(); c++) {
+        uint16_t b = toFixed(centers[c][0]), g = toFixed(centers[c][1]), r = toFixed(centers[c][2]);
+        packed.bg[c] = static_cast<int32_t>((uint32_t)g << 16 | b);
+        packed.r0[c] = r;
+    }
+    return packed;
+}
+
+static inline int32_t distanceScalar(const PackedPixels& px, size_t i, const PackedCenters& centers, int c)
+{
+    int32_t db = px.bg[2 * i] - static_cast<int16_t>(centers.bg[c] & 0xFFFF);
+    int32_t dg = px.bg[2 * i + 1] - static_cast<int16_t>(centers.bg[c] >> 16);
+    int32_t dr = px.r0[2 * i] - static_cast<int16_t>(centers.r0[c]);
+    return db * db + dg * dg + dr * dr;
+}
+
+static inline void nearestScalar(const PackedPixels& px, size_t i, const PackedCenters& centers, int k, uint8_t& label, int32_t& dist)
+{
+    int32_t best = INT32_MAX;
+    int bestIdx = 0;
+    for (int c = 0; c < k; c++) {
+        int32_t d = distanceScalar(px, i, centers, c);
+        if (d < best) {
+            best = d;
+            bestIdx = c;
+        }
+    }
+    label = static_cast<uint8_t>(bestIdx);
+    dist = best;
+}
+
+// SUMS: the pixels are summed per center (int32 lanes, moved to int64 every FUSED_BLOCK pixels, long before 2040 per
+// pixel could overflow them) while they are still in registers
+constexpr size_t FUSED_BLOCK = size_t(1) << 20;
+
+#if defined(KMEANS_AVX2)
+static int64_t laneSum(__m256i v)
+{
+    alignas(32) uint32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v);
+    int64_t sum = 0;
+    for (uint32_t lane : lanes) sum += lane;
+    return sum;
+}
+#elif defined(KMEANS_SSE41)
+static int64_t laneSum(__m128i v)
+{
+    alignas(16) uint32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), v);
+    return (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+
+// labels[i] = nearest center (first one on ties), dist[i] = its squared distance in fixed point units.
+// With SUMS also what accumulate() gives for unweighted pixels, into zeroed sums and counts: returns the sum of dist
+template <int K, bool SUMS>
+static int64_t assignLabels(const PackedPixels& px, const PackedCenters& centers, int k, uint8_t* labels, int32_t* dist,
+                            int64_t* sums = nullptr, size_t* counts = nullptr)
+{
+    const int kk = K > 0 ? K : k;
+    size_t i = 0;
+    int64_t compactness = 0;
+
+#if defined(KMEANS_AVX2)
+    __m256i cbg[KMEANS_MAX_K], cr0[KMEANS_MAX_K], idx[KMEANS_MAX_K];
+    for (int c = 0; c < kk; c++) {
+        cbg[c] = _mm256_set1_epi32(centers.bg[c]);
+        cr0[c] = _mm256_set1_epi32(centers.r0[c]);
+        idx[c] = _mm256_set1_epi32(c);
+    }
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    __m256i acc[4 * KMEANS_MAX_K]; // b, g, r and count per center
+    __m256i distSum = _mm256_setzero_si256();
+
+    alignas(32) int32_t lanes[8];
+    const size_t end = px.n & ~size_t(7);
+    while (i < end) {
+        const size_t blockEnd = std::min(end, i + FUSED_BLOCK);
+        if constexpr (SUMS) {
+            for (int a = 0; a < 4 * kk; a++) acc[a] = _mm256_setzero_si256();
+        }
+
+        for (; i < blockEnd; i += 8) {
+            __m256i bg = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(px.bg.data() + 2 * i));
+            __m256i r0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(px.r0.data() + 2 * i));
+            __m256i best = _mm256_set1_epi32(INT32_MAX);
+            __m256i bestIdx = _mm256_setzero_si256();
+
+            for (int c = 0; c < kk; c++) {
+                __m256i dbg = _mm256_sub_epi16(bg, cbg[c]);
+                __m256i dr = _mm256_sub_epi16(r0, cr0[c]);
+                __m256i d = _mm256_add_epi32(_mm256_madd_epi16(dbg, dbg), _mm256_madd_epi16(dr, dr));
+                __m256i closer = _mm256_cmpgt_epi32(best, d);
+                best = _mm256_min_epi32(best, d);
+                bestIdx = _mm256_or_si256(_mm256_andnot_si256(closer, bestIdx), _mm256_and_si256(closer, idx[c]));
+            }
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dist + i), best);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), bestIdx);
+            for (int l = 0; l < 8; l++) labels[i + l] = static_cast<uint8_t>(lanes[l]);
+
+            if constexpr (SUMS) {
+                // channels are never negative: b is the low half of (b, g), r the whole (r, 0) pair
+                __m256i b = _mm256_and_si256(bg, low16), g = _mm256_srli_epi32(bg, 16);
+                for (int c = 0; c < kk; c++) {
+                    __m256i mine = _mm256_cmpeq_epi32(bestIdx, idx[c]);
+                    acc[4 * c] = _mm256_add_epi32(acc[4 * c], _mm256_and_si256(mine, b));
+                    acc[4 * c + 1] = _mm256_add_epi32(acc[4 * c + 1], _mm256_and_si256(mine, g));
+                    acc[4 * c + 2] = _mm256_add_epi32(acc[4 * c + 2], _mm256_and_si256(mine, r0));
+                    acc[4 * c + 3] = _mm256_sub_epi32(acc[4 * c + 3], mine);
+                }
+                distSum = _mm256_add_epi64(distSum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(best)));
+                distSum = _mm256_add_epi64(distSum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(best, 1)));
+            }
+        }
+
+        if constexpr (SUMS) {
+            for (int c = 0; c < kk; c++) {
+                for (int ch = 0; ch < 3; ch++) sums[3 * c + ch] += laneSum(acc[4 * c + ch]);
+                counts[c] += laneSum(acc[4 * c + 3]);
+            }
+        }
+    }
+    if constexpr (SUMS) {
+        alignas(32) int64_t quads[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(quads), distSum);
+        compactness = quads[0] + quads[1] + quads[2] + quads[3];
+    }
+#elif defined(KMEANS_SSE41)
+    __m128i cbg[KMEANS_MAX_K], cr0[KMEANS_MAX_K], idx[KMEANS_MAX_K];
+    for (int c = 0; c < kk; c++) {
+        cbg[c] = _mm_set1_epi32(centers.bg[c]);
+        cr0[c] = _mm_set1_epi32(centers.r0[c]);
+        idx[c] = _mm_set1_epi32(c);
+    }
+    const __m128i low16 = _mm_set1_epi32(0xFFFF);
+    __m128i acc[4 * KMEANS_MAX_K];
+    __m128i distSum = _mm_setzero_si128();
+
+    alignas(16) int32_t lanes[4];
+    const size_t end = px.n & ~size_t(3);
+    while (i < end) {
+        const size_t blockEnd = std::min(end, i + FUSED_BLOCK);
+        if constexpr (SUMS) {
+            for (int a = 0; a < 4 * kk; a++) acc[a] = _mm_setzero_si128();
+        }
+
+        for (; i < blockEnd; i += 4) {
+            __m128i bg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px.bg.data() + 2 * i));
+            __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px.r0.data() + 2 * i));
+            __m128i best = _mm_set1_epi32(INT32_MAX);
+            __m128i bestIdx = _mm_setzero_si128();
+
+            for (int c = 0; c < kk; c++) {
+                __m128i dbg = _mm_sub_epi16(bg, cbg[c]);
+                __m128i dr = _mm_sub_epi16(r0, cr0[c]);
+                __m128i d = _mm_add_epi32(_mm_madd_epi16(dbg, dbg), _mm_madd_epi16(dr, dr));
+                __m128i closer = _mm_cmpgt_epi32(best, d);
+                best = _mm_min_epi32(best, d);
+                bestIdx = _mm_or_si128(_mm_andnot_si128(closer, bestIdx), _mm_and_si128(closer, idx[c]));
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dist + i), best);
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), bestIdx);
+            for (int l = 0; l < 4; l++) labels[i + l] = static_cast<uint8_t>(lanes[l]);
+
+            if constexpr (SUMS) {
+                __m128i b = _mm_and_si128(bg, low16), g = _mm_srli_epi32(bg, 16);
+                for (int c = 0; c < kk; c++) {
+                    __m128i mine = _mm_cmpeq_epi32(bestIdx, idx[c]);
+                    acc[4 * c] = _mm_add_epi32(acc[4 * c], _mm_and_si128(mine, b));
+                    acc[4 * c + 1] = _mm_add_epi32(acc[4 * c + 1], _mm_and_si128(mine, g));
+                    acc[4 * c + 2] = _mm_add_epi32(acc[4 * c + 2], _mm_and_si128(mine, r0));
+                    acc[4 * c + 3] = _mm_sub_epi32(acc[4 * c + 3], mine);
+                }
+                distSum = _mm_add_epi64(distSum, _mm_cvtepu32_epi64(best));
+                distSum = _mm_add_epi64(distSum, _mm_cvtepu32_epi64(_mm_srli_si128(best, 8)));
+            }
+        }
+
+        if constexpr (SUMS) {
+            for (int c = 0; c < kk; c++) {
+                for (int ch = 0; ch < 3; ch++) sums[3 * c + ch] += laneSum(acc[4 * c + ch]);
+                counts[c] += laneSum(acc[4 * c + 3]);
+            }
+        }
+    }
+    if constexpr (SUMS) {
+        alignas(16) int64_t pair[2];
+        _mm_store_si128(reinterpret_cast<__m128i*>(pair), distSum);
+        compactness = pair[0] + pair[1];
+    }
+#endif
+
+    for (; i < px.n; i++) {
+        nearestScalar(px, i, centers, kk, labels[i], dist[i]);
+        if constexpr (SUMS) {
+            int c = labels[i];
+            sums[3 * c] += px.bg[2 * i];
+            sums[3 * c + 1] += px.bg[2 * i + 1];
+            sums[3 * c + 2] += px.r0[2 * i];
+            counts[c]++;
+            compactness += dist[i];
+        }
+    }
+    return compactness;
+}
+
+static void assign(const PackedPixels& px, const PackedCenters& centers, int k, uint8_t* labels, int32_t* dist)
+{
+    switch (k) {
+        case 3: assignLabels<3, false>(px, centers, k, labels, dist); break;
+        case 4: assignLabels<4, false>(px, centers, k, labels, dist); break;
+        case 5: assignLabels<5, false>(px, centers, k, labels, dist); break;
+        case 6: assignLabels<6, false>(px, centers, k, labels, dist); break;
+        case 8: assignLabels<8, false>(px, centers, k, labels, dist); break;
+        default: assignLabels<0, false>(px, centers, k, labels, dist); break;
+    }
+}
+
+static cv::Vec3f pixelAt(const PackedPixels& px, size_t i)
+{
+    return cv::Vec3f(px.bg[2 * i], px.bg[2 * i + 1], px.r0[2 * i]) / static_cast<float>(FIXED_ONE);
+}
+
+// k-means++: each next center is a pixel picked with probability proportional to its squared distance to the closest center so far
+// (times its weight, so a histogram bin counts as often as the pixels in it)
+static std::vector<cv::Vec3f> seedCenters(const PackedPixels& px, int k, std::mt19937_64& rng, std::vector<uint8_t>& labels,
+                                          std::vector<int32_t>& dist, std::vector<int32_t>& closest)
+{
+    std::vector<cv::Vec3f> centers;
+    size_t first = 0;
+    if (px.weights.empty()) { first = std::uniform_int_distribution<size_t>(0, px.n - 1)(rng); }
+    else {
+        int64_t total = 0;
+        for (uint32_t w : px.weights) total += w;
+        int64_t pick = std::uniform_int_distribution<int64_t>(0, total - 1)(rng);
+        for (; first + 1 < px.n && pick >= px.weights[first]; first++) pick -= px.weights[first];
+    }
+    centers.push_back(pixelAt(px, first));
+
+    // distances to the newest center come from the assignment kernel (k = 1) and the total from a loop that
+    // vectorizes, the pick walks the running sum again and stops at the chosen point
+    closest.assign(px.n, INT32_MAX);
+    while ((int)centers.size() < k) {
+        assign(px, packCenters({centers.back()}), 1, labels.data(), dist.data());
+        int64_t total = 0;
+        if (px.weights.empty()) {
+            for (size_t i = 0; i < px.n; i++) {
+                closest[i] = std::min(closest[i], dist[i]);
+                total += closest[i];
+            }
+        }
+        else {
+            for (size_t i = 0; i < px.n; i++) {
+                closest[i] = std::min(closest[i], dist[i]);
+                total += (int64_t)closest[i] * px.weights[i];
+            }
+        }
+        if (total == 0) break; // fewer distinct colors than k
+
+        int64_t pick = std::uniform_int_distribution<int64_t>(0, total - 1)(rng);
+        size_t chosen = 0;
+        for (; chosen + 1 < px.n && pick >= (int64_t)closest[chosen] * px.weight(chosen); chosen++) {
+            pick -= (int64_t)closest[chosen] * px.weight(chosen);
+        }
+        centers.push_back(pixelAt(px, chosen));
+    }
+    return centers;
+}
+
+// per center sums of the assigned points (fixed point, times their weight) and pixel counts,
+// returns the weighted sum of dist
+static int64_t accumulate(const PackedPixels& px, const uint8_t* labels, const int32_t* dist, std::vector<int64_t>& sums,
+                          std::vector<size_t>& counts)
+{
+    std::fill(sums.begin(), sums.end(), 0);
+    std::fill(counts.begin(), counts.end(), 0);
+    int64_t compactness = 0;
+    if (px.weights.empty()) {
+        for (size_t i = 0; i < px.n; i++) {
+            int c = labels[i];
+            sums[3 * c] += px.bg[2 * i];
+            sums[3 * c + 1] += px.bg[2 * i + 1];
+            sums[3 * c + 2] += px.r0[2 * i];
+            counts[c]++;
+            compactness += dist[i];
+        }
+    }
+    else {
+        for (size_t i = 0; i < px.n; i++) {
+            int c = labels[i];
+            int64_t w = px.weights[i];
+            sums[3 * c] += w * px.bg[2 * i];
+            sums[3 * c + 1] += w * px.bg[2 * i + 1];
+            sums[3 * c + 2] += w * px.r0[2 * i];
+            counts[c] += w;
+            compactness += w * dist[i];
+        }
+    }
+    return compactness;
+}
+
+// assign() then accumulate(), in one pass over the pixels when they are unweighted
+static int64_t assignAccumulate(const PackedPixels& px, const PackedCenters& centers, int k, uint8_t* labels, int32_t* dist,
+                                std::vector<int64_t>& sums, std::vector<size_t>& counts)
+{
+    if (!px.weights.empty()) {
+        assign(px, centers, k, labels, dist);
+        return accumulate(px, labels, dist, sums, counts);
+    }
+
+    std::fill(sums.begin(), sums.end(), 0);
+    std::fill(counts.begin(), counts.end(), 0);
+    switch (k) {
+        case 3: return assignLabels<3, true>(px, centers, k, labels, dist, sums.data(), counts.data());
+        case 4: return assignLabels<4, true>(px, centers, k, labels, dist, sums.data(), counts.data());
+        case 5: return assignLabels<5, true>(px, centers, k, labels, dist, sums.data(), counts.data());
+        case 6: return assignLabels<6, true>(px, centers, k, labels, dist, sums.data(), counts.data());
+        case 8: return assignLabels<8, true>(px, centers, k, labels, dist, sums.data(), counts.data());
+        default: return assignLabels<0, true>(px, centers, k, labels, dist, sums.data(), counts.data());
+    }
+}
+
+// an empty cluster takes over the point of the most populated cluster farthest from its center, like cv::kmeans.
+// A point never leaves a cluster it makes up alone (a weighted point can be all of it): when the most populated
+// cluster is one point the farthest point of any other cluster is taken, with none the cluster stays empty and
+// keeps its center. Returns the moved points so callers keeping per point state can reset it
+static std::vector<size_t> fillEmptyClusters(const PackedPixels& px, int k, uint8_t* labels, std::vector<int32_t>& dist,
+                                             std::vector<int64_t>& sums, std::vector<size_t>& counts)
+{
+    std::vector<size_t> moved;
+    for (int c = 0; c < k; c++) {
+        if (counts[c] > 0) continue;
+        int largest = std::max_element(counts.begin(), counts.begin() + k) - counts.begin();
+        size_t far = SIZE_MAX, farOther = SIZE_MAX;
+        for (size_t i = 0; i < px.n; i++) {
+            if (px.weight(i) >= counts[labels[i]]) continue;
+            size_t& best = labels[i] == largest ? far : farOther;
+            if (best == SIZE_MAX || dist[i] > dist[best]) best = i;
+        }
+        if (far == SIZE_MAX) far = farOther;
+        if (far == SIZE_MAX) continue;
+        int from = labels[far];
+        int64_t w = px.weight(far);
+        counts[from] -= w;
+        sums[3 * from] -= w * px.bg[2 * far];
+        sums[3 * from + 1] -= w * px.bg[2 * far + 1];
+        sums[3 * from + 2] -= w * px.r0[2 * far];
+        labels[far] = c;
+        dist[far] = 0;
+        counts[c] = w;
+        sums[3 * c] = w * px.bg[2 * far];
+        sums[3 * c + 1] = w * px.bg[2 * far + 1];
+        sums[3 * c + 2] = w * px.r0[2 * far];
+        moved.push_back(far);
+    }
+    return moved;
+}
+
+// centers = sums / counts, an empty cluster keeps its center; returns the largest squared move of a center
+static double moveCenters(const std::vector<int64_t>& sums, const std::vector<size_t>& counts, std::vector<cv::Vec3f>& centers)
+{
+    double maxShift2 = 0.0;
+    for (size_t c = 0; c < centers.size(); c++) {
+        if (counts[c] == 0) continue;
+        float scale = 1.0f / (counts[c] * FIXED_ONE);
+        cv::Vec3f center(sums[3 * c] * scale, sums[3 * c + 1] * scale, sums[3 * c + 2] * scale);
+        cv::Vec3f shift = center - centers[c];
+        maxShift2 = std::max(maxShift2, (double)shift.dot(shift));
+        centers[c] = center;
+    }
+    return maxShift2;
+}
+
+static KmeansResult runAttempt(const PackedPixels& px, std::vector<cv::Vec3f>&& seeds, const KmeansParams& params,
+                               std::vector<uint8_t>& labels, std::vector<int32_t>& dist)
+{
+    KmeansResult result;
+    result.centers = std::move(seeds);
+    int k = result.centers.size();
+
+    double epsilon2 = params.epsilon * params.epsilon;
+    std::vector<int64_t> sums(3 * k);
+    result.counts.assign(k, 0);
+
+    for (int iter = 0; iter < std::max(params.maxIterations, 1); iter++) {
+        int64_t compactness = assignAccumulate(px, packCenters(result.centers), k, labels.data(), dist.data(), sums, result.counts);
+        result.iterations = iter + 1;
+        result.distances += px.n * k;
+
+        result.compactness = static_cast<double>(compactness) / (FIXED_ONE * FIXED_ONE);
+
+        fillEmptyClusters(px, k, labels.data(), dist, sums, result.counts);
+        if (moveCenters(sums, result.counts, result.centers) <= epsilon2) break;
+    }
+
+    return result;
+}
+
+static float centerDistance(const PackedCenters& a, int i, const PackedCenters& b, int j)
+{
+    int32_t db = static_cast<int16_t>(a.bg[i] & 0xFFFF) - static_cast<int16_t>(b.bg[j] & 0xFFFF);
+    int32_t dg = static_cast<int16_t>(a.bg[i] >> 16) - static_cast<int16_t>(b.bg[j] >> 16);
+    int32_t dr = static_cast<int16_t>(a.r0[i]) - static_cast<int16_t>(b.r0[j]);
+    return std::sqrt(static_cast<float>(db * db + dg * dg + dr * dr));
+}
+
+// one point of a Hamerly iteration whose bounds already moved and failed the test: tighten the upper bound
+// with the distance to its own center, if that is not enough compare against every center.
+// Returns the distances computed
+static inline uint64_t hamerlyVisit(const PackedPixels& px, size_t i, const PackedCenters& packed, int k, float bound,
+                                    uint8_t* labels, int32_t* dist, float* upper, float* lower)
+{
+    int label = labels[i];
+    dist[i] = distanceScalar(px, i, packed, label);
+    upper[i] = std::sqrt(static_cast<float>(dist[i]));
+    if (upper[i] <= bound) return 1;
+
+    int32_t best = dist[i], second = INT32_MAX;
+    for (int c = 0; c < k; c++) {
+        if (c == labels[i]) continue;
+        int32_t d = distanceScalar(px, i, packed, c);
+        if (d < best || (d == best && c < label)) {
+            second = best;
+            best = d;
+            label = c;
+        }
+        else if (d < second) {
+            second = d;
+        }
+    }
+    labels[i] = label;
+    dist[i] = best;
+    upper[i] = std::sqrt(static_cast<float>(best));
+    lower[i] = second == INT32_MAX ? HUGE_VALF : std::sqrt(static_cast<float>(second));
+    return k;
+}
+
+// Hamerly's algorithm: every point keeps an upper bound on the distance to its own center and a lower bound
+// on the distance to any other. A point whose upper bound is below both the lower bound and half the distance
+// from its center to the nearest other center cannot change cluster and is skipped without computing a
+// distance. Bounds are in fixed point units against the rounded centers that distances are computed with, so
+// the clusters are those of runAttempt up to near ties.
+static KmeansResult runAttemptBounded(const PackedPixels& px, std::vector<cv::Vec3f>&& seeds, const KmeansParams& params,
+                                      std::vector<uint8_t>& labels, std::vector<int32_t>& dist)
+{
+    KmeansResult result;
+    result.centers = std::move(seeds);
+    int k = result.centers.size();
+
+    double epsilon2 = params.epsilon * params.epsilon;
+    std::vector<int64_t> sums(3 * k);
+    result.counts.assign(k, 0);
+
+    std::vector<float> upper(px.n, HUGE_VALF), lower(px.n, 0.0f);
+    float half[KMEANS_MAX_K] = {}, shift[KMEANS_MAX_K] = {};
+    float maxShift = 0.0f, secondShift = 0.0f;
+    int maxIdx = 0;
+    PackedCenters packed = packCenters(result.centers);
+    std::fill(labels.begin(), labels.end(), 0);
+    uint64_t computed = 0;
+
+    for (int iter = 0; iter < std::max(params.maxIterations, 1); iter++) {
+        for (int c = 0; c < k; c++) {
+            half[c] = HUGE_VALF;
+            for (int o = 0; o < k; o++) {
+                if (o != c) half[c] = std::min(half[c], 0.5f * centerDistance(packed, c, packed, o));
+            }
+        }
+
+        for (size_t i = 0; i < px.n; i++) {
+            int label = labels[i];
+            upper[i] += shift[label];
+            lower[i] -= label == maxIdx ? secondShift : maxShift;
+            float bound = std::max(half[label], lower[i]);
+            if (upper[i] > bound) computed += hamerlyVisit(px, i, packed, k, bound, labels.data(), dist.data(), upper.data(), lower.data());
+        }
+        accumulate(px, labels.data(), dist.data(), sums, result.counts);
+        result.iterations = iter + 1;
+
+        // dist of skipped points is from an earlier iteration, good enough to pick the farthest point
+        for (size_t i : fillEmptyClusters(px, k, labels.data(), dist, sums, result.counts)) {
+            upper[i] = HUGE_VALF; // forces a full pass over the centers next iteration
+            lower[i] = 0.0f;
+        }
+        bool converged = moveCenters(sums, result.counts, result.centers) <= epsilon2;
+
+        PackedCenters moved = packCenters(result.centers);
+        maxShift = secondShift = 0.0f;
+        for (int c = 0; c < k; c++) {
+            shift[c] = centerDistance(packed, c, moved, c);
+            if (shift[c] > maxShift) {
+                secondShift = maxShift;
+                maxShift = shift[c];
+                maxIdx = c;
+            }
+            else if (shift[c] > secondShift) {
+                secondShift = shift[c];
+            }
+        }
+        packed = moved;
+        if (converged) break;
+    }
+
+    // compactness against the final centers
+    int64_t compactness = 0;
+    for (size_t i = 0; i < px.n; i++) compactness += (int64_t)px.weight(i) * distanceScalar(px, i, packed, labels[i]);
+    result.compactness = static_cast<double>(compactness) / (FIXED_ONE * FIXED_ONE);
+
+    uint64_t plain = (uint64_t)px.n * k * result.iterations;
+    result.distances = computed + px.n;
+    result.distancesSkipped = plain > computed ? plain - computed : 0;
+
+    return result;
+}
+
+// means of the most populated bins of a 16x16x16 histogram, a bin next to one already taken (or to one of
+// the given centers) only once nothing else is left
+static std::vector<cv::Vec3f> peakCenters(const PackedPixels& px, int k, std::vector<cv::Vec3f> centers = {})
+{
+    constexpr int BITS = 4, SHIFT = 8 - BITS + FIXED_BITS, BINS = 1 << (3 * BITS);
+    std::vector<uint64_t> count(BINS, 0);
+    std::vector<int64_t> sums(3 * BINS, 0);
+    for (size_t i = 0; i < px.n; i++) {
+        int bin = (px.bg[2 * i] >> SHIFT) << (2 * BITS) | (px.bg[2 * i + 1] >> SHIFT) << BITS | (px.r0[2 * i] >> SHIFT);
+        int64_t w = px.weight(i);
+        count[bin] += w;
+        sums[3 * bin] += w * px.bg[2 * i];
+        sums[3 * bin + 1] += w * px.bg[2 * i + 1];
+        sums[3 * bin + 2] += w * px.r0[2 * i];
+    }
+
+    std::vector<int> order;
+    for (int bin = 0; bin < BINS; bin++) {
+        if (count[bin] > 0) order.push_back(bin);
+    }
+    std::stable_sort(order.begin(), order.end(), [&count](int a, int b) { return count[a] > count[b]; });
+
+    auto binOf = [](const cv::Vec3f& c) {
+        int b = std::clamp((int)c[0], 0, 255) >> (8 - BITS), g = std::clamp((int)c[1], 0, 255) >> (8 - BITS);
+        int r = std::clamp((int)c[2], 0, 255) >> (8 - BITS);
+        return b << (2 * BITS) | g << BITS | r;
+    };
+    auto adjacent = [](int a, int b) {
+        for (int ch = 0; ch < 3; ch++) {
+            int shift = ch * BITS;
+            if (std::abs(((a >> shift) & ((1 << BITS) - 1)) - ((b >> shift) & ((1 << BITS) - 1))) > 1) return false;
+        }
+        return true;
+    };
+
+    std::vector<int> taken;
+    for (const cv::Vec3f& c : centers) taken.push_back(binOf(c));
+    for (int pass = 0; pass < 2; pass++) {
+        for (int bin : order) {
+            if ((int)centers.size() >= k) return centers;
+            bool skip = false;
+            for (int t : taken) skip = skip || (pass == 0 ? adjacent(bin, t) : bin == t);
+            if (skip) continue;
+            float scale = 1.0f / (count[bin] * FIXED_ONE);
+            centers.push_back(cv::Vec3f(sums[3 * bin] * scale, sums[3 * bin + 1] * scale, sums[3 * bin + 2] * scale));
+            taken.push_back(bin);
+        }
+    }
+    return centers;
+}
+
+// of the anchors, the k that are nearest to the most pixels; topped up with histogram peaks when fewer than k
+// anchors are nearest to any pixel. More than KMEANS_MAX_K anchors are assigned KMEANS_MAX_K at a time, each
+// pixel keeping the nearest so far (the first one on ties, like a single pass)
+static std::vector<cv::Vec3f> anchorCenters(const PackedPixels& px, int k, const std::vector<cv::Vec3f>& anchors,
+                                            std::vector<uint8_t>& labels, std::vector<int32_t>& dist)
+{
+    const int m = anchors.size();
+    std::vector<uint64_t> votes(m, 0);
+    std::vector<int> nearest; // over all passes, only when there is more than one
+    std::vector<int32_t> nearestDist;
+    if (m > KMEANS_MAX_K) {
+        nearest.assign(px.n, 0);
+        nearestDist.assign(px.n, INT32_MAX);
+    }
+    for (int first = 0; first < m; first += KMEANS_MAX_K) {
+        int count = std::min(KMEANS_MAX_K, m - first);
+        std::vector<cv::Vec3f> pass(anchors.begin() + first, anchors.begin() + first + count);
+        assign(px, packCenters(pass), count, labels.data(), dist.data());
+        if (m <= KMEANS_MAX_K) {
+            for (size_t i = 0; i < px.n; i++) votes[labels[i]] += px.weight(i);
+            continue;
+        }
+        for (size_t i = 0; i < px.n; i++) {
+            if (dist[i] < nearestDist[i]) {
+                nearestDist[i] = dist[i];
+                nearest[i] = first + labels[i];
+            }
+        }
+    }
+    for (size_t i = 0; i < nearest.size(); i++) votes[nearest[i]] += px.weight(i);
+
+    std::vector<int> order;
+    for (int a = 0; a < m; a++) {
+        if (votes[a] > 0) order.push_back(a);
+    }
+    std::stable_sort(order.begin(), order.end(), [&votes](int a, int b) { return votes[a] > votes[b]; });
+
+    std::vector<cv::Vec3f> centers;
+    for (size_t j = 0; j < order.size() && (int)centers.size() < k; j++) centers.push_back(anchors[order[j]]);
+    return peakCenters(px, k, std::move(centers));
+}
+
+static std::atomic<uint64_t> totalDistances{0}, totalSkipped{0}, totalRuns{0}, totalIterations{0};
+
+KmeansCounters kmeansCounters() { return {totalDistances.load(), totalSkipped.load(), totalRuns.load(), totalIterations.load()}; }
+
+static void addTotals(uint64_t distances, uint64_t skipped, uint64_t runs, uint64_t iterations)
+{
+    totalDistances += distances;
+    totalSkipped += skipped;
+    totalRuns += runs;
+    totalIterations += iterations;
+}
+
+// Buffers kept per thread between calls: on the grouper's 150 px images allocating and faulting in fresh ones was
+// a noticeable part of every call. Released after a call on more than SCRATCH_KEEP points, which covers those
+// (at most 150x150) but not the 800x600 KMeans images, so workers don't keep ~8 MB each after such a call.
+struct Scratch {
+    PackedPixels px;
+    std::vector<uint8_t> labels;
+    std::vector<int32_t> dist;
+    std::vector<int32_t> closest; // k-means++ seeding
+};
+
+constexpr size_t SCRATCH_KEEP = size_t(1) << 15;
+
+static Scratch& scratch()
+{
+    static thread_local Scratch buffers;
+    return buffers;
+}
+
+static void trimScratch()
+{
+    Scratch& s = scratch();
+    if (s.px.bg.capacity() > 2 * SCRATCH_KEEP || s.labels.capacity() > SCRATCH_KEEP) s = Scratch();
+}
+
+static KmeansResult cluster(const PackedPixels& px, const KmeansParams& params)
+{
+    if (px.n == 0) return KmeansResult();
+
+    int k = static_cast<int>(std::clamp<size_t>(std::max(params.k, 1), 1, std::min<size_t>(KMEANS_MAX_K, px.n)));
+    Scratch& buffers = scratch();
+    std::vector<uint8_t>& labels = buffers.labels;
+    std::vector<int32_t>& dist = buffers.dist;
+    labels.resize(px.n);
+    dist.resize(px.n);
+    std::mt19937_64 rng(params.seed);
+
+    // anchors and peaks always give the same seeds, a second attempt would repeat the first
+    int attempts = params.seeding == KmeansSeeding::PLUS_PLUS ? std::max(params.attempts, 1) : 1;
+
+    KmeansResult best;
+    uint64_t distances = 0, skipped = 0, iterations = 0;
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        std::vector<cv::Vec3f> seeds;
+        switch (params.seeding) {
+            case KmeansSeeding::PLUS_PLUS: seeds = seedCenters(px, k, rng, labels, dist, buffers.closest); break;
+            case KmeansSeeding::ANCHORS:   seeds = anchorCenters(px, k, params.anchors, labels, dist); break;
+            case KmeansSeeding::PEAKS:     seeds = peakCenters(px, k); break;
+        }
+
+        KmeansResult result = params.bounded ? runAttemptBounded(px, std::move(seeds), params, labels, dist)
+                                             : runAttempt(px, std::move(seeds), params, labels, dist);
+        distances += result.distances;
+        skipped += result.distancesSkipped;
+        iterations += result.iterations;
+        if (attempt == 0 || result.compactness < best.compactness) best = std::move(result);
+    }
+    best.distances = distances;
+    best.distancesSkipped = skipped;
+    addTotals(distances, skipped, attempts, iterations);
+    return best;
+}
+
+// the centers of the image halved down to params.pyramid, refined level by level up to the full image until a
+// level moves none further than params.pyramidTolerance; counts and compactness are of the full image
+static KmeansResult clusterPyramid(const cv::Mat& image, const KmeansParams& params)
+{
+    std::vector<cv::Mat> levels = {image};
+    while (std::max(levels.back().cols, levels.back().rows) > params.pyramid) {
+        const cv::Mat& top = levels.back();
+        cv::Mat half;
+        cv::resize(top, half, cv::Size((top.cols + 1) / 2, (top.rows + 1) / 2), 0, 0, cv::INTER_AREA);
+        levels.push_back(half);
+    }
+
+    KmeansResult result = cluster(packPixels(levels.back()), params);
+    if (result.centers.empty()) return result;
+
+    double tolerance2 = params.pyramidTolerance * params.pyramidTolerance;
+    size_t level = levels.size() - 1;
+    while (level > 0) {
+        level--;
+        PackedPixels px = packPixels(levels[level]);
+        std::vector<uint8_t> labels(px.n);
+        std::vector<int32_t> dist(px.n);
+        std::vector<cv::Vec3f> seeds = result.centers;
+        KmeansResult next = params.bounded ? runAttemptBounded(px, std::move(seeds), params, labels, dist)
+                                           : runAttempt(px, std::move(seeds), params, labels, dist);
+        addTotals(next.distances, next.distancesSkipped, 1, next.iterations);
+
+        double moved2 = 0.0;
+        for (size_t c = 0; c < next.centers.size(); c++) {
+            cv::Vec3f shift = next.centers[c] - result.centers[c];
+            moved2 = std::max(moved2, (double)shift.dot(shift));
+        }
+        next.distances += result.distances;
+        next.distancesSkipped += result.distancesSkipped;
+        next.iterations += result.iterations;
+        result = std::move(next);
+        if (moved2 <= tolerance2) break;
+    }
+
+    if (level > 0) {
+        PackedPixels px = packPixels(image);
+        std::vector<uint8_t> labels(px.n);
+        std::vector<int32_t> dist(px.n);
+        std::vector<int64_t> sums(3 * result.centers.size());
+        int k = result.centers.size();
+        int64_t compactness = assignAccumulate(px, packCenters(result.centers), k, labels.data(), dist.data(), sums, result.counts);
+        result.compactness = static_cast<double>(compactness) / (FIXED_ONE * FIXED_ONE);
+        result.distances += px.n * k;
+        addTotals(px.n * k, 0, 0, 0);
+    }
+    return result;
+}
+
+// mini-batch k-means (Sculley) centers, moved to the means of their pixels by a last pass over the image that
+// also gives exact counts and compactness; memory stays O(batch) whatever the image size
+constexpr int MINI_BATCH_STEPS = 100;
+
+static KmeansResult clusterMiniBatch(const cv::Mat& image, const KmeansParams& params)
+{
+    std::mt19937_64 rng(params.seed);
+    PackedPixels px;
+    packSample(image, 16 * params.miniBatch, rng, px);
+    KmeansResult result = cluster(px, params);
+    trimScratch();
+    if (result.centers.empty()) return result;
+
+    int k = result.centers.size();
+    std::vector<double> seen(result.counts.begin(), result.counts.end());
+    std::vector<uint8_t> labels(params.miniBatch);
+    std::vector<int32_t> dist(params.miniBatch);
+    std::vector<int64_t> sums(3 * k);
+    std::vector<size_t> counts(k);
+    double epsilon2 = params.epsilon * params.epsilon;
+
+    int steps = 0;
+    while (steps < MINI_BATCH_STEPS) {
+        packSample(image, params.miniBatch, rng, px);
+        assignAccumulate(px, packCenters(result.centers), k, labels.data(), dist.data(), sums, counts);
+        steps++;
+
+        double maxShift2 = 0.0;
+        for (int c = 0; c < k; c++) {
+            if (counts[c] == 0) continue;
+            seen[c] += counts[c];
+            float rate = static_cast<float>(counts[c] / seen[c]);
+            float scale = 1.0f / (counts[c] * FIXED_ONE);
+            cv::Vec3f mean(sums[3 * c] * scale, sums[3 * c + 1] * scale, sums[3 * c + 2] * scale);
+            cv::Vec3f shift = (mean - result.centers[c]) * rate;
+            result.centers[c] += shift;
+            maxShift2 = std::max(maxShift2, (double)shift.dot(shift));
+        }
+        if (maxShift2 <= epsilon2) break;
+    }
+    uint64_t distances = (uint64_t)steps * params.miniBatch * k;
+
+    int rowsPerChunk = std::max<int>(1, params.miniBatch / std::max(image.cols, 1));
+    PackedCenters packed = packCenters(result.centers);
+    std::vector<int64_t> total(3 * k, 0);
+    std::fill(result.counts.begin(), result.counts.end(), 0);
+    int64_t compactness = 0;
+    for (int y = 0; y < image.rows; y += rowsPerChunk) {
+        packRows(image, y, std::min(y + rowsPerChunk, image.rows), px);
+        labels.resize(px.n);
+        dist.resize(px.n);
+        compactness += assignAccumulate(px, packed, k, labels.data(), dist.data(), sums, counts);
+        for (int c = 0; c < k; c++) {
+            result.counts[c] += counts[c];
+            for (int ch = 0; ch < 3; ch++) total[3 * c + ch] += sums[3 * c + ch];
+        }
+    }
+    for (int c = 0; c < k; c++) {
+        if (result.counts[c] == 0) continue; // keeps its center, weight 0
+        float scale = 1.0f / (result.counts[c] * FIXED_ONE);
+        result.centers[c] = cv::Vec3f(total[3 * c] * scale, total[3 * c + 1] * scale, total[3 * c + 2] * scale);
+    }
+    result.compactness = static_cast<double>(compactness) / (FIXED_ONE * FIXED_ONE);
+    result.iterations += steps + 1;
+    distances += image.total() * k;
+    result.distances += distances;
+    addTotals(distances, 0, 1, steps + 1);
+    return result;
+}
+
+KmeansResult kmeansColors(const cv::Mat& image, const KmeansParams& params)
+{
+    CV_Assert(image.type() == CV_8UC3);
+    if (params.miniBatch > 0 && image.total() > 64 * params.miniBatch) return clusterMiniBatch(image, params);
+    if (params.pyramid > 0 && std::max(image.cols, image.rows) > params.pyramid) return clusterPyramid(image, params);
+
+    PackedPixels& px = scratch().px;
+    packRows(image, 0, image.rows, px);
+    KmeansResult result = cluster(px, params);
+    trimScratch();
+    return result;
+}
+
+KmeansResult kmeansHistogram(const cv::Mat& image, const KmeansParams& params, int bits)
+{
+    CV_Assert(image.type() == CV_8UC3);
+    CV_Assert(bits >= 1 && bits <= 6);
+    KmeansResult result = cluster(packHistogram(image, bits), params);
+    trimScratch();
+    return result;
+}
+
+// a range [begin, end) of the histogram points in `order` with its bounds, total weight and squared error
+struct CutBox {
+    size_t begin, end;
+    int16_t lo[3], hi[3];
+    uint64_t weight;
+    double error; // sum of weight * squared distance to the box mean, in fixed point units
+};
+
+static int16_t channelOf(const PackedPixels& px, size_t i, int ch) { return ch == 2 ? px.r0[2 * i] : px.bg[2 * i + ch]; }
+
+// running sums of weight, weight * value and weight * value² over points, enough for a mean and an error
+struct Moments {
+    double w = 0.0, s[3] = {0.0, 0.0, 0.0}, q = 0.0;
+
+    void add(const PackedPixels& px, size_t i)
+    {
+        double wi = px.weight(i);
+        w += wi;
+        for (int ch = 0; ch < 3; ch++) {
+            double v = channelOf(px, i, ch);
+            s[ch] += wi * v;
+            q += wi * v * v;
+        }
+    }
+
+    double error() const { return w > 0.0 ? q - (s[0] * s[0] + s[1] * s[1] + s[2] * s[2]) / w : 0.0; }
+};
+
+static CutBox makeBox(const PackedPixels& px, const std::vector<uint32_t>& order, size_t begin, size_t end)
+{
+    CutBox box = {begin, end, {INT16_MAX, INT16_MAX, INT16_MAX}, {INT16_MIN, INT16_MIN, INT16_MIN}, 0, 0.0};
+    Moments m;
+    for (size_t j = begin; j < end; j++) {
+        for (int ch = 0; ch < 3; ch++) {
+            int16_t v = channelOf(px, order[j], ch);
+            box.lo[ch] = std::min(box.lo[ch], v);
+            box.hi[ch] = std::max(box.hi[ch], v);
+        }
+        box.weight += px.weight(order[j]);
+        m.add(px, order[j]);
+    }
+    box.error = m.error();
+    return box;
+}
+
+static int longestAxis(const CutBox& box)
+{
+    int axis = 0;
+    for (int ch = 1; ch < 3; ch++) {
+        if (box.hi[ch] - box.lo[ch] > box.hi[axis] - box.lo[axis]) axis = ch;
+    }
+    return axis;
+}
+
+KmeansResult medianCutColors(const cv::Mat& image, int k, int bits)
+{
+    CV_Assert(image.type() == CV_8UC3);
+    CV_Assert(bits >= 1 && bits <= 6);
+
+    KmeansResult result;
+    PackedPixels px = packHistogram(image, bits);
+    if (px.n == 0) return result;
+    k = std::clamp(k, 1, KMEANS_MAX_K);
+
+    // bins are visited in index order and ties are broken by index, so the output depends on the pixels only
+    std::vector<uint32_t> order(px.n);
+    for (size_t i = 0; i < px.n; i++) order[i] = i;
+
+    std::vector<CutBox> boxes = {makeBox(px, order, 0, px.n)};
+    std::vector<double> suffixError(px.n + 1);
+    while ((int)boxes.size() < k) {
+        int pick = -1;
+        for (size_t b = 0; b < boxes.size(); b++) {
+            if (boxes[b].end - boxes[b].begin > 1 && (pick < 0 || boxes[b].error > boxes[pick].error)) pick = b;
+        }
+        if (pick < 0 || boxes[pick].error <= 0.0) break; // fewer distinct colors than k
+
+        // sort the box along its longest axis and cut where the two halves have the least total error
+        CutBox box = boxes[pick];
+        int axis = longestAxis(box);
+        std::sort(order.begin() + box.begin, order.begin() + box.end, [&px, axis](uint32_t a, uint32_t b) {
+            int16_t va = channelOf(px, a, axis), vb = channelOf(px, b, axis);
+            return va != vb ? va < vb : a < b;
+        });
+
+        Moments right;
+        for (size_t j = box.end; j-- > box.begin;) {
+            right.add(px, order[j]);
+            suffixError[j - box.begin] = right.error();
+        }
+        Moments left;
+        size_t cut = box.begin + 1;
+        double best = -1.0;
+        for (size_t j = box.begin + 1; j < box.end; j++) {
+            left.add(px, order[j - 1]);
+            double error = left.error() + suffixError[j - box.begin];
+            if (best < 0.0 || error < best) {
+                best = error;
+                cut = j;
+            }
+        }
+
+        boxes[pick] = makeBox(px, order, box.begin, cut);
+        boxes.push_back(makeBox(px, order, cut, box.end));
+    }
+
+    for (const CutBox& box : boxes) {
+        int64_t sum[3] = {0, 0, 0};
+        for (size_t j = box.begin; j < box.end; j++) {
+            for (int ch = 0; ch < 3; ch++) sum[ch] += (int64_t)px.weight(order[j]) * channelOf(px, order[j], ch);
+        }
+        float scale = 1.0f / (box.weight * FIXED_ONE);
+        result.centers.push_back(cv::Vec3f(sum[0] * scale, sum[1] * scale, sum[2] * scale));
+        result.counts.push_back(box.weight);
+        result.compactness += box.error / (FIXED_ONE * FIXED_ONE);
+    }
+    return result;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// k-means for 3-channel 8-bit color data with k <= KMEANS_MAX_K, a drop-in for cv::kmeans on pixels.
+// Pixels stay int16 fixed point (3 fractional bits) instead of being converted to float, the assignment step
+// runs 8 (AVX2) or 4 (SSE4.1) pixels per instruction when the build enables them (-march=native), plain C++
+// otherwise. k is a template parameter for the common values so the inner loop over centers unrolls.
+constexpr int KMEANS_MAX_K = 16;
+
+enum class KmeansSeeding {
+    PLUS_PLUS, // k-means++, random: best of `attempts` runs
+    ANCHORS,   // the k anchors nearest to the most pixels, one run
+    PEAKS,     // means of the k most populated, non adjacent bins of a 16³ histogram, one run
+};
+
+struct KmeansParams {
+    int k = 5;
+    int maxIterations = 20;
+    double epsilon = 1.0; // stop once no center moved further than this (same meaning as cv::TermCriteria::EPS)
+    int attempts = 3;     // best compactness of this many k-means++ seeded runs
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    KmeansSeeding seeding = KmeansSeeding::PLUS_PLUS; // ANCHORS and PEAKS are deterministic and ignore attempts
+    std::vector<cv::Vec3f> anchors;                   // BGR candidates for ANCHORS, any number
+    int pyramid = 0;                                  // > 0: cluster coarse to fine from this longest side (kmeansColors)
+    double pyramidTolerance = 1.0;                    // stop at the level that moved no center further than this
+    size_t miniBatch = 0; // > 0: kmeansColors on images over 64 batches runs mini-batch k-means with this batch size
+    // Hamerly's triangle inequality bounds: same clusters with most distance computations skipped. Each point
+    // still costs bound updates and a branch per iteration: this wins over the plain assignment only when
+    // distances are what is expensive (builds without SIMD, more so at large k), not against the SIMD kernel
+    bool bounded = false;
+};
+
+struct KmeansResult {
+    std::vector<cv::Vec3f> centers; // BGR
+    std::vector<size_t> counts;     // pixels per center
+    double compactness = 0.0;       // sum of squared distances to the assigned center
+    int iterations = 0;             // of the attempt that was kept
+    uint64_t distances = 0;         // point to center distances computed, all attempts
+    uint64_t distancesSkipped = 0;  // of the ones plain k-means computes, skipped by the bounds
+};
+
+// summed over every call in this process
+struct KmeansCounters {
+    uint64_t distances = 0;
+    uint64_t skipped = 0;
+    uint64_t runs = 0;       // attempts
+    uint64_t iterations = 0; // of all attempts, iterations / runs is the average until convergence
+};
+
+KmeansCounters kmeansCounters();
+
+// image: CV_8UC3
+KmeansResult kmeansColors(const cv::Mat& image, const KmeansParams& params);
+
+// Same clustering over the distinct colors instead of the pixels: one pass bins the pixels into a histogram
+// with `bits` per channel (5: 32³ bins), each non-empty bin becomes a point at the mean color of its pixels
+// weighted by their count. An iteration costs the number of occupied bins, not the image size. counts are
+// still pixels; compactness is measured to the bin means, so it leaves out the spread inside each bin.
+KmeansResult kmeansHistogram(const cv::Mat& image, const KmeansParams& params, int bits = 5);
+
+// Median cut over the same histogram: the box of occupied bins with the largest squared error is sorted along
+// its longest axis and cut where the two halves have the least total error (the variance-based cut, which
+// keeps well separated colors apart better than a cut at the pixel median), until there are k boxes. Each
+// center is the weighted mean of its box. No seed and no iterations: the same pixels always give the same
+// colors, in one pass over the pixels plus a sort of at most 2^(3*bits) bins per cut. iterations is 0.
+KmeansResult medianCutColors(const cv::Mat& image, int k, int bits = 5);
@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 
+#include "kmeans.hpp"
+
 struct ColorInfo {
     cv::Vec3b color;
     int count;
@@ -13,6 +15,13 @@ struct ColorInfo {
     double hue;
 };
 
+enum PALETTE_ALGORITHM {
+    PALETTE_KMEANS,
+    PALETTE_MEDIAN_CUT,
+    PALETTE_KMEANS_BOUNDED,
+    PALETTE_ALGORITHM_COUNT
+};
+
 struct PaletteGroup {
     std::vector<ColorInfo> colors;
     std::string name;
@@ -22,6 +31,7 @@ class ColorPaletteExtractor {
   private:
     cv::Mat image;
     std::vector<ColorInfo> palette;
+    PALETTE_ALGORITHM algorithm = PALETTE_KMEANS;
 
     // Convert BGR to HSV and calculate color properties
     void calculateColorProperties(ColorInfo& colorInfo)
@@ -36,37 +46,65 @@ class ColorPaletteExtractor {
         colorInfo.brightness = hsv[2] / 255.0;
     }
 
-    // Extract dominant colors using K-means clustering
-    void extractPalette(int k = 8)
+    // cv::kmeans on float data, for palettes larger than the kmeans.hpp engine takes (KMEANS_MAX_K)
+    KmeansResult kmeansOpenCV(int k)
     {
-        if (image.empty()) return;
-
-        // Reshape image to a 2D array of pixels
         cv::Mat data = image.reshape(1, image.rows * image.cols);
         data.convertTo(data, CV_32F);
 
-        // Apply K-means clustering
         cv::Mat labels, centers;
         cv::kmeans(data, k, labels,
                    cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20, 1.0),
                    3, cv::KMEANS_PP_CENTERS, centers);
 
-        // Count occurrences of each cluster
-        std::vector<int> counts(k, 0);
+        KmeansResult result;
+        result.counts.assign(k, 0);
         for (int i = 0; i < labels.rows; i++) {
-            counts[labels.at<int>(i)]++;
+            result.counts[labels.at<int>(i)]++;
+        }
+        for (int i = 0; i < k; i++) {
+            result.centers.push_back(cv::Vec3f(centers.at<float>(i, 0), centers.at<float>(i, 1), centers.at<float>(i, 2)));
+        }
+        return result;
+    }
+
+    // Extract dominant colors using K-means clustering or median cut
+    void extractPalette(int k = 8)
+    {
+        if (image.empty()) return;
+
+        KmeansResult result;
+        if (k > KMEANS_MAX_K) {
+            std::cout << "More than " << KMEANS_MAX_K << " colors: clustering with cv::kmeans" << std::endl;
+            result = kmeansOpenCV(std::min<int>(k, image.total()));
+        }
+        else if (algorithm == PALETTE_MEDIAN_CUT) {
+            result = medianCutColors(image, k);
+        }
+        else {
+            // Apply K-means clustering on the packed 8-bit pixels
+            KmeansParams params;
+            params.k = k;
+            params.maxIterations = 20;
+            params.attempts = 3;
+            params.bounded = algorithm == PALETTE_KMEANS_BOUNDED;
+            params.miniBatch = 16384; // over 1M pixels: mini-batches, memory does not grow with the image
+            result = kmeansColors(image, params);
+            if (params.bounded) {
+                std::cout << "Distance computations: " << result.distances << ", skipped " << result.distancesSkipped << std::endl;
+            }
         }
 
         // Convert centers to color info
-        palette.reserve(k);
+        palette.reserve(result.centers.size());
         palette.clear();
-        for (int i = 0; i < k; i++) {
+        for (size_t i = 0; i < result.centers.size(); i++) {
             ColorInfo colorInfo;
             colorInfo.color = cv::Vec3b(
-                static_cast<uchar>(centers.at<float>(i, 0)),
-                static_cast<uchar>(centers.at<float>(i, 1)),
-                static_cast<uchar>(centers.at<float>(i, 2)));
-            colorInfo.count = counts[i];
+                static_cast<uchar>(result.centers[i][0]),
+                static_cast<uchar>(result.centers[i][1]),
+                static_cast<uchar>(result.centers[i][2]));
+            colorInfo.count = result.counts[i];
             calculateColorProperties(colorInfo);
             palette.push_back(colorInfo);
         }
@@ -177,6 +215,8 @@ class ColorPaletteExtractor {
     }
 
   public:
+    void setAlgorithm(PALETTE_ALGORITHM value) { algorithm = value; }
+
     bool loadImage(const std::string& imagePath)
     {
         image = cv::imread(imagePath);
@@ -245,20 +285,40 @@ int main(int argc, char* argv[])
 {
     std::string imagePath;
     int numColors = 8;
+    int algorithm = PALETTE_KMEANS;
+
+    // -a/--algorithm may appear anywhere, the rest are <image_path> [num_colors] in that order
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-a" || arg == "--algorithm") && i + 1 < argc) { algorithm = std::atoi(argv[++i]); }
+        else {
+            positional.push_back(arg);
+        }
+    }
+    if (algorithm < 0 || algorithm >= PALETTE_ALGORITHM_COUNT) {
+        std::cout << "Unknown algorithm, expected KMeans = 0, Median cut = 1, KMeans with Hamerly bounds = 2" << std::endl;
+        return -1;
+    }
 
-    if (argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <image_path> [num_colors]" << std::endl;
+    if (positional.empty()) {
+        std::cout << "Usage: " << argv[0] << " <image_path> [num_colors] [-a 0-2 (KMeans = 0, Median cut = 1, KMeans with Hamerly bounds = 2)]" << std::endl;
         std::cout << "Enter image path: ";
         std::getline(std::cin, imagePath);
     }
     else {
-        imagePath = argv[1];
-        if (argc >= 3) {
-            numColors = std::atoi(argv[2]);
+        imagePath = positional[0];
+        if (positional.size() >= 2) {
+            numColors = std::atoi(positional[1].c_str());
         }
     }
+    if (numColors < 1) {
+        std::cout << "num_colors must be at least 1" << std::endl;
+        return -1;
+    }
 
     ColorPaletteExtractor extractor;
+    extractor.setAlgorithm(static_cast<PALETTE_ALGORITHM>(algorithm));
 
     if (!extractor.loadImage(imagePath)) {
         return -1;
@@ -0,0 +1,503 @@
+#include "scanner.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "utils.hpp"
+
+// record layout returned by getdents64, glibc only declares it behind _GNU_SOURCE on newer versions
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+constexpr size_t DIRENT_BUFFER = 64 * 1024; // ~1000 entries per syscall
+
+// a directory changed within this long before the snapshot was taken may change again within the same
+// mtime tick without the mtime moving, so it is read again on the next scan
+constexpr int64_t RACY_WINDOW_NS = 2000000000LL;
+
+constexpr char SNAPSHOT_MAGIC[8] = {'W', 'P', 'U', 'S', 'C', 'A', 'N', 'S'};
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+DirectoryScanner::DirectoryScanner(int threads, bool followLinks)
+    : numThreads(threads > 0 ? threads : defaultThreadCount()), followLinks(followLinks) {}
+
+bool DirectoryScanner::firstVisit(uint64_t dev, uint64_t ino)
+{
+    Shard& shard = inodes[InodeHash()({dev, ino}) % SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.seen.insert({dev, ino}).second;
+}
+
+void DirectoryScanner::push(std::string&& dir)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(dir));
+        active++;
+    }
+    cv.notify_one();
+}
+
+void DirectoryScanner::readDirectory(const std::string& dir, int threadId, const Callback& onFile, Stats& stats)
+{
+    // the directory's own identity catches symlink loops and directories reached twice
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        stats.errors++;
+        return;
+    }
+    if (!firstVisit(st.st_dev, st.st_ino)) {
+        stats.duplicates++;
+        return;
+    }
+    stats.directories++;
+
+    std::string prefix = dir;
+    if (prefix.back() != '/') prefix += '/';
+
+    DirectoryRecord* record = nullptr;
+    if (!recorded.empty()) {
+        recorded[threadId].emplace_back(dir, DirectoryRecord());
+        record = &recorded[threadId].back().second;
+        record->dev = st.st_dev;
+        record->ino = st.st_ino;
+        record->mtimeNs = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+
+    auto emitFile = [&](const char* name, uint64_t dev, uint64_t ino, bool symlink, bool hardlinked) {
+        if (record) record->files.push_back({name, dev, ino, symlink, hardlinked});
+        if (symlink || hardlinked) {
+            candidates[threadId].push_back({prefix + name, dev, ino, symlink});
+            return;
+        }
+        firstVisit(dev, ino); // the only path to this inode, symlinks to it lose later
+        stats.files++;
+        onFile(prefix + name, threadId);
+    };
+    auto emitDirectory = [&](const char* name) {
+        if (record) record->subdirs.push_back(name);
+        push(prefix + name);
+    };
+    auto emitLinkedDirectory = [&](const char* name) {
+        if (record) record->linkedDirs.push_back(name);
+        linkedDirs[threadId].push_back(prefix + name);
+    };
+
+    // unchanged since the snapshot: adding, removing or renaming an entry would have bumped the mtime
+    if (previous) {
+        const DirectoryRecord* old = previous->find(dir);
+        int64_t mtimeNs = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        if (old && old->dev == (uint64_t)st.st_dev && old->ino == (uint64_t)st.st_ino && old->mtimeNs == mtimeNs &&
+            mtimeNs < previous->takenNs - RACY_WINDOW_NS) {
+            stats.reused++;
+            stats.entries += old->files.size() + old->subdirs.size();
+            for (const auto& file : old->files) emitFile(file.name.c_str(), file.dev, file.ino, file.symlink, file.hardlinked);
+            for (const auto& subdir : old->subdirs) emitDirectory(subdir.c_str());
+            for (const auto& link : old->linkedDirs) emitLinkedDirectory(link.c_str());
+            return;
+        }
+    }
+    if (record) record->reread = true;
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        stats.errors++;
+        return;
+    }
+
+    std::vector<char> buffer(DIRENT_BUFFER);
+    while (true) {
+        long bytes = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (bytes < 0) stats.errors++;
+        if (bytes <= 0) break;
+
+        for (long pos = 0; pos < bytes;) {
+            const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + pos);
+            pos += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            stats.entries++;
+
+            unsigned char type = entry->d_type;
+            uint64_t dev = st.st_dev;
+            uint64_t ino = entry->d_ino;
+
+            if (type == DT_UNKNOWN) {
+                struct stat own;
+                if (fstatat(fd, name, &own, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(own.st_mode) ? DT_DIR : S_ISREG(own.st_mode) ? DT_REG : S_ISLNK(own.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+
+            // symlinks are classified by their target, the (dev, inode) checks keep them from looping
+            bool symlink = type == DT_LNK;
+            if (symlink) {
+                struct stat target;
+                if (fstatat(fd, name, &target, 0) != 0) continue;
+                type = S_ISDIR(target.st_mode) ? DT_DIR : S_ISREG(target.st_mode) ? DT_REG : DT_UNKNOWN;
+                dev = target.st_dev;
+                ino = target.st_ino;
+            }
+
+            if (type == DT_DIR) {
+                if (!symlink) { emitDirectory(name); }
+                else if (followLinks) { emitLinkedDirectory(name); }
+            }
+            else if (type == DT_REG && isSupportedFormat(name)) {
+                // hardlinks only show in the link count
+                bool hardlinked = false;
+                if (!symlink) {
+                    struct stat own;
+                    if (fstatat(fd, name, &own, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                    dev = own.st_dev;
+                    ino = own.st_ino;
+                    hardlinked = own.st_nlink > 1;
+                }
+                emitFile(name, dev, ino, symlink, hardlinked);
+            }
+        }
+    }
+
+    close(fd);
+}
+
+void DirectoryScanner::worker(int threadId, const Callback& onFile, Stats& stats)
+{
+    while (true) {
+        std::string dir;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !pending.empty() || active == 0; });
+            if (pending.empty()) return;
+            dir = std::move(pending.front());
+            pending.pop_front();
+        }
+
+        readDirectory(dir, threadId, onFile, stats);
+
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = --active == 0;
+        }
+        if (finished) cv.notify_all();
+    }
+}
+
+void DirectoryScanner::walk(const Callback& onFile, std::vector<Stats>& stats)
+{
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([this, t, &onFile, &stats] { worker(t, onFile, stats[t]); });
+    }
+    for (auto& thread : threads) thread.join();
+}
+
+// per inode: the regular entry if one was emitted already, else non-symlinks first, then the smallest path
+void DirectoryScanner::emitCandidates(const Callback& onFile, Stats& stats)
+{
+    std::vector<Candidate> all;
+    for (auto& list : candidates) {
+        std::move(list.begin(), list.end(), std::back_inserter(all));
+        list.clear();
+    }
+    std::sort(all.begin(), all.end(), [](const Candidate& a, const Candidate& b) {
+        if (a.dev != b.dev) return a.dev < b.dev;
+        if (a.ino != b.ino) return a.ino < b.ino;
+        if (a.symlink != b.symlink) return !a.symlink;
+        return a.path < b.path;
+    });
+
+    for (size_t i = 0; i < all.size(); i++) {
+        if (i > 0 && all[i].dev == all[i - 1].dev && all[i].ino == all[i - 1].ino) {
+            stats.duplicates++;
+            continue;
+        }
+        if (!firstVisit(all[i].dev, all[i].ino)) {
+            stats.duplicates++;
+            continue;
+        }
+        stats.files++;
+        onFile(std::move(all[i].path), 0);
+    }
+}
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static std::string joinPath(const std::string& dir, const std::string& name)
+{
+    return dir.back() == '/' ? dir + name : dir + "/" + name;
+}
+
+// only directories read during this scan can differ from their previous record
+static void diffSnapshots(const ScanSnapshot& previous, const ScanSnapshot& next, ScanChanges& changes)
+{
+    for (const auto& [dir, record] : next.dirs) {
+        if (!record.reread) continue;
+
+        std::unordered_map<std::string, const DirectoryRecord::File*> before;
+        auto old = previous.dirs.find(dir);
+        if (old != previous.dirs.end()) {
+            for (const auto& file : old->second.files) before[file.name] = &file;
+        }
+
+        for (const auto& file : record.files) {
+            auto it = before.find(file.name);
+            if (it == before.end()) { changes.added.push_back(joinPath(dir, file.name)); }
+            else {
+                if (it->second->ino != file.ino || it->second->dev != file.dev) changes.modified.push_back(joinPath(dir, file.name));
+                before.erase(it);
+            }
+        }
+        for (const auto& [name, file] : before) changes.removed.push_back(joinPath(dir, name));
+    }
+
+    for (const auto& [dir, record] : previous.dirs) {
+        if (next.dirs.count(dir)) continue;
+        for (const auto& file : record.files) changes.removed.push_back(joinPath(dir, file.name));
+    }
+
+    std::sort(changes.added.begin(), changes.added.end());
+    std::sort(changes.removed.begin(), changes.removed.end());
+    std::sort(changes.modified.begin(), changes.modified.end());
+}
+
+DirectoryScanner::Stats DirectoryScanner::scan(const std::string& root, const Callback& onFile, const ScanSnapshot* previous,
+                                               ScanSnapshot* next, ScanChanges* changes)
+{
+    auto start = std::chrono::steady_clock::now();
+    int64_t takenNs = nowNs();
+
+    for (auto& shard : inodes) shard.seen.clear();
+    pending.clear();
+    active = 0;
+    this->previous = previous;
+    recorded.clear();
+    if (next || changes) recorded.resize(numThreads);
+    candidates.assign(numThreads, {});
+    linkedDirs.assign(numThreads, {});
+
+    std::vector<Stats> threadStats(numThreads);
+    push(std::string(root));
+    walk(onFile, threadStats);
+
+    // symlinked directories: each round walks the links found in the previous one, one link at a time in
+    // path order, so which path claims a directory reachable through several links does not depend on timing
+    while (true) {
+        std::vector<std::string> links;
+        for (auto& list : linkedDirs) {
+            std::move(list.begin(), list.end(), std::back_inserter(links));
+            list.clear();
+        }
+        if (links.empty()) break;
+        std::sort(links.begin(), links.end());
+        for (auto& link : links) {
+            push(std::move(link));
+            walk(onFile, threadStats);
+        }
+    }
+    emitCandidates(onFile, threadStats[0]);
+
+    Stats total;
+    for (const auto& s : threadStats) {
+        total.directories += s.directories;
+        total.entries += s.entries;
+        total.files += s.files;
+        total.duplicates += s.duplicates;
+        total.errors += s.errors;
+        total.reused += s.reused;
+    }
+
+    if (!recorded.empty()) {
+        ScanSnapshot snapshot;
+        snapshot.root = root;
+        snapshot.takenNs = takenNs;
+        snapshot.followLinks = followLinks;
+        for (auto& list : recorded) {
+            for (auto& entry : list) snapshot.dirs.emplace(std::move(entry.first), std::move(entry.second));
+        }
+        recorded.clear();
+
+        if (changes) {
+            *changes = ScanChanges();
+            diffSnapshots(previous ? *previous : ScanSnapshot(), snapshot, *changes);
+            changes->directories = total.directories;
+            changes->reused = total.reused;
+        }
+        if (next) *next = std::move(snapshot);
+    }
+    this->previous = nullptr;
+
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return total;
+}
+
+const DirectoryRecord* ScanSnapshot::find(const std::string& dir) const
+{
+    auto it = dirs.find(dir);
+    return it == dirs.end() ? nullptr : &it->second;
+}
+
+static void writeString(std::ostream& out, const std::string& str)
+{
+    uint32_t length = str.size();
+    out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.write(str.data(), length);
+}
+
+// limit: the size of the whole file, a longer string can only come from a corrupt one
+static bool readString(std::istream& in, std::string& str, uint64_t limit)
+{
+    uint32_t length = 0;
+    if (!in.read(reinterpret_cast<char*>(&length), sizeof(length)) || length > limit) return false;
+    str.resize(length);
+    return static_cast<bool>(in.read(&str[0], length));
+}
+
+template <typename T>
+static void writeValue(std::ostream& out, const T& value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool readValue(std::istream& in, T& value)
+{
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+// header, root, then per directory: path, identity, mtime, files (name, dev, inode, link flags), subdirectory
+// names, symlinked subdirectory names
+bool ScanSnapshot::load(const std::string& path, const std::string& expectedRoot)
+{
+    dirs.clear();
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+
+    // lengths and counts are checked against the file size before anything is allocated for them: every string
+    // takes at least its 4 byte length, every file entry that plus its identity and flags. A truncated or corrupt
+    // snapshot is then a failed load, treated like a missing one, instead of a huge allocation
+    in.seekg(0, std::ios::end);
+    const uint64_t size = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+    const uint64_t maxStrings = size / sizeof(uint32_t);
+    const uint64_t maxFiles = size / (sizeof(uint32_t) + sizeof(DirectoryRecord::File::dev) + sizeof(DirectoryRecord::File::ino) + sizeof(uint8_t));
+
+    char magic[8];
+    uint32_t version = 0;
+    uint64_t count = 0;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(in, version) || version != SNAPSHOT_VERSION || !readString(in, root, size) || root != expectedRoot ||
+        !readValue(in, takenNs) || !readValue(in, followLinks) || !readValue(in, count) || count > maxStrings) {
+        return false;
+    }
+
+    dirs.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        std::string dir;
+        DirectoryRecord record;
+        uint64_t files = 0, subdirs = 0;
+        if (!readString(in, dir, size) || !readValue(in, record.dev) || !readValue(in, record.ino) ||
+            !readValue(in, record.mtimeNs) || !readValue(in, files) || files > maxFiles) {
+            dirs.clear();
+            return false;
+        }
+
+        record.files.resize(files);
+        for (auto& file : record.files) {
+            uint8_t flags = 0;
+            if (!readString(in, file.name, size) || !readValue(in, file.dev) || !readValue(in, file.ino) || !readValue(in, flags)) {
+                dirs.clear();
+                return false;
+            }
+            file.symlink = flags & 1;
+            file.hardlinked = flags & 2;
+        }
+
+        if (!readValue(in, subdirs) || subdirs > maxStrings) {
+            dirs.clear();
+            return false;
+        }
+        record.subdirs.resize(subdirs);
+        for (auto& subdir : record.subdirs) {
+            if (!readString(in, subdir, size)) {
+                dirs.clear();
+                return false;
+            }
+        }
+
+        uint64_t links = 0;
+        if (!readValue(in, links) || links > maxStrings) {
+            dirs.clear();
+            return false;
+        }
+        record.linkedDirs.resize(links);
+        for (auto& link : record.linkedDirs) {
+            if (!readString(in, link, size)) {
+                dirs.clear();
+                return false;
+            }
+        }
+
+        dirs.emplace(std::move(dir), std::move(record));
+    }
+    return true;
+}
+
+bool ScanSnapshot::save(const std::string& path) const
+{
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+
+        out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        writeValue(out, SNAPSHOT_VERSION);
+        writeString(out, root);
+        writeValue(out, takenNs);
+        writeValue(out, followLinks);
+        writeValue(out, (uint64_t)dirs.size());
+
+        for (const auto& [dir, record] : dirs) {
+            writeString(out, dir);
+            writeValue(out, record.dev);
+            writeValue(out, record.ino);
+            writeValue(out, record.mtimeNs);
+            writeValue(out, (uint64_t)record.files.size());
+            for (const auto& file : record.files) {
+                writeString(out, file.name);
+                writeValue(out, file.dev);
+                writeValue(out, file.ino);
+                writeValue(out, (uint8_t)(file.symlink | file.hardlinked << 1));
+            }
+            writeValue(out, (uint64_t)record.subdirs.size());
+            for (const auto& subdir : record.subdirs) writeString(out, subdir);
+            writeValue(out, (uint64_t)record.linkedDirs.size());
+            for (const auto& link : record.linkedDirs) writeString(out, link);
+        }
+        if (!out) return false;
+    }
+    return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// what a directory held when it was last read; a directory whose (dev, inode, mtime) still matches
+// is not read again, its files and subdirectories come from here
+struct DirectoryRecord {
+    struct File {
+        std::string name;
+        uint64_t dev = 0;
+        uint64_t ino = 0;
+        bool symlink = false;    // the entry is a symlink, dev/ino are its target's
+        bool hardlinked = false; // link count > 1
+    };
+
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    int64_t mtimeNs = 0;
+    std::vector<File> files; // supported images only
+    std::vector<std::string> subdirs;
+    std::vector<std::string> linkedDirs; // symlinks to directories, only recorded when links are followed
+    bool reread = false; // read during this scan, not saved
+};
+
+// directory mtimes and entry lists of one scan, saved between runs to make the next scan incremental
+class ScanSnapshot {
+  public:
+    std::string root;
+    int64_t takenNs = 0;
+    bool followLinks = false;
+    std::unordered_map<std::string, DirectoryRecord> dirs;
+
+    bool load(const std::string& path, const std::string& expectedRoot);
+    bool save(const std::string& path) const;
+    const DirectoryRecord* find(const std::string& dir) const;
+};
+
+// difference between the previous snapshot and this scan; a file counts as modified when its inode changed
+// (replaced by a rename or a rewrite to a new file), edits in place that keep the inode are not seen here
+struct ScanChanges {
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    std::vector<std::string> modified;
+    size_t directories = 0;
+    size_t reused = 0; // directories taken from the snapshot without reading them
+};
+
+// Parallel directory walker. Every directory is one work item, its entries are read with getdents64 and
+// classified by d_type (a stat only when the filesystem reports DT_UNKNOWN or the entry is a symlink, and one
+// per image file for its link count). Image paths are handed to the callback as soon as they are found.
+//
+// Files and directories are deduplicated by (dev, inode) without depending on thread timing. A file with a
+// single link that is not a symlink is emitted right away. Hardlinked files and symlinks to files are held
+// until the walk is done, then each inode is emitted once: from a regular entry if there is one, otherwise
+// the lexicographically smallest path. Symlinks to directories are only followed with followLinks (the
+// old recursive_directory_iterator did not follow them). They are walked after the real tree, one at a time
+// in path order, so a directory reachable both ways is always listed under its real path.
+class DirectoryScanner {
+  public:
+    // called concurrently from scanner threads, threadId is in [0, threads())
+    using Callback = std::function<void(std::string&& path, int threadId)>;
+
+    struct Stats {
+        size_t directories = 0;
+        size_t entries = 0;
+        size_t files = 0;
+        size_t duplicates = 0; // hardlinks, symlinks to already seen files or directories
+        size_t errors = 0;     // directories that could not be opened or read
+        size_t reused = 0;     // directories unchanged since the previous snapshot, not read again
+        double seconds = 0.0;
+    };
+
+    explicit DirectoryScanner(int threads = 0, bool followLinks = false);
+
+    // returns once the whole tree under root has been walked. With a previous snapshot only directories
+    // whose mtime changed are read; next receives the snapshot of this scan, changes what differs
+    Stats scan(const std::string& root, const Callback& onFile, const ScanSnapshot* previous = nullptr,
+               ScanSnapshot* next = nullptr, ScanChanges* changes = nullptr);
+
+    int threads() const { return numThreads; }
+    bool followsLinks() const { return followLinks; }
+
+  private:
+    static constexpr size_t SHARDS = 64;
+
+    struct InodeHash {
+        size_t operator()(const std::pair<uint64_t, uint64_t>& key) const { return (key.first * 0x9E3779B97F4A7C15ull) ^ key.second; }
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_set<std::pair<uint64_t, uint64_t>, InodeHash> seen;
+    };
+
+    // a file that may be reachable by more than one path, decided on once the walk is done
+    struct Candidate {
+        std::string path;
+        uint64_t dev;
+        uint64_t ino;
+        bool symlink;
+    };
+
+    int numThreads;
+    bool followLinks;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> pending;
+    size_t active = 0; // directories queued or being read, the walk is done when this drops to 0
+
+    std::array<Shard, SHARDS> inodes;
+
+    const ScanSnapshot* previous = nullptr;
+    std::vector<std::vector<std::pair<std::string, DirectoryRecord>>> recorded; // per thread, when a next snapshot is wanted
+    std::vector<std::vector<Candidate>> candidates;                              // per thread
+    std::vector<std::vector<std::string>> linkedDirs;                            // per thread, walked after the current round
+
+    bool firstVisit(uint64_t dev, uint64_t ino);
+    void push(std::string&& dir);
+    void worker(int threadId, const Callback& onFile, Stats& stats);
+    void walk(const Callback& onFile, std::vector<Stats>& stats); // until no directory is pending
+    void emitCandidates(const Callback& onFile, Stats& stats);
+    void readDirectory(const std::string& dir, int threadId, const Callback& onFile, Stats& stats);
+};
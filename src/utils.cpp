@@ -1,16 +1,32 @@
 
 #include "utils.hpp"
+#include "scanner.hpp"
 
 #include <algorithm>
+#include <argparse/argparse.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <opencv2/opencv.hpp>
 #include <ostream>
 #include <string>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 std::vector<std::string> supportedExtensions = {
@@ -18,35 +34,59 @@ std::vector<std::string> supportedExtensions = {
 
 bool isSupportedFormat(const std::string& filename)
 {
-    std::string extension = filename.substr(filename.find_last_of("."));
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) return false;
+    std::string extension = filename.substr(dot);
     std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
     return std::find(supportedExtensions.begin(), supportedExtensions.end(), extension) != supportedExtensions.end();
 }
 
-size_t scanFolder(std::vector<std::string>& imageFiles, const std::string& folderPath)
+// full scan without a snapshot path, otherwise only folders changed since the saved snapshot are read
+static DirectoryScanner::Stats scanIncremental(DirectoryScanner& scanner, const std::string& folderPath, const DirectoryScanner::Callback& onFile,
+                                               const std::string& snapshotPath, ScanChanges* changes)
+{
+    if (snapshotPath.empty()) return scanner.scan(folderPath, onFile);
+
+    ScanSnapshot previous;
+    ScanSnapshot next;
+    // a snapshot taken with the other link setting lists different directories
+    bool havePrevious = previous.load(snapshotPath, folderPath) && previous.followLinks == scanner.followsLinks();
+    DirectoryScanner::Stats stats = scanner.scan(folderPath, onFile, havePrevious ? &previous : nullptr, &next, changes);
+    next.save(snapshotPath);
+    return stats;
+}
+
+size_t scanFolder(std::vector<std::string>& imageFiles, const std::string& folderPath, const std::string& snapshotPath, ScanChanges* changes,
+                  bool followLinks)
 {
     std::cout << "Scanning folder: " << folderPath << std::endl;
 
-    if (!std::filesystem::exists(folderPath)) {
+    if (!std::filesystem::is_directory(folderPath)) {
         std::cerr << "Error scanning folder: " << folderPath << std::endl;
         return 0;
     }
 
-    try {
-        for (const auto& entry : std::filesystem::recursive_directory_iterator(folderPath)) {
-            if (entry.is_regular_file() && isSupportedFormat(entry.path().filename().string())) {
-                imageFiles.push_back(entry.path().string());
-            }
-        }
-    }
-    catch (const std::filesystem::filesystem_error& ex) {
-        std::cerr << "Error scanning folder: " << ex.what() << std::endl;
-        exit(1);
-        return 0;
+    // per-thread lists, merged and sorted at the end so the order doesn't depend on thread timing
+    DirectoryScanner scanner(0, followLinks);
+    std::vector<std::vector<std::string>> found(scanner.threads());
+    DirectoryScanner::Stats stats = scanIncremental(scanner, folderPath, [&found](std::string&& path, int threadId) {
+        found[threadId].push_back(std::move(path));
+    }, snapshotPath, changes);
+
+    size_t start = imageFiles.size();
+    imageFiles.reserve(start + stats.files);
+    for (auto& list : found) {
+        std::move(list.begin(), list.end(), std::back_inserter(imageFiles));
     }
+    std::sort(imageFiles.begin() + start, imageFiles.end());
 
-    size_t totalCount = imageFiles.size();
-    std::cout << "Found " << totalCount << " image files." << std::endl;
+    size_t totalCount = imageFiles.size() - start;
+    std::cout << "Found " << totalCount << " image files in " << stats.directories << " folders ("
+              << std::fixed << std::setprecision(2) << stats.seconds << "s";
+    if (stats.duplicates > 0) std::cout << ", " << stats.duplicates << " duplicate links skipped";
+    if (stats.errors > 0) std::cout << ", " << stats.errors << " unreadable folders";
+    std::cout << ")." << std::endl;
+    if (changes) printScanChanges(*changes);
 
     if (totalCount == 0) {
         std::cout << "No images found." << std::endl;
@@ -55,6 +95,13 @@ size_t scanFolder(std::vector<std::string>& imageFiles, const std::string& folde
     return totalCount;
 }
 
+void printScanChanges(const ScanChanges& changes)
+{
+    std::cout << "Rescan: " << changes.reused << "/" << changes.directories << " folders unchanged, "
+              << changes.added.size() << " added, " << changes.removed.size() << " removed, "
+              << changes.modified.size() << " modified" << std::endl;
+}
+
 size_t getImages(std::vector<std::string>& images, const std::string& inputPath)
 {
 
@@ -67,6 +114,830 @@ size_t getImages(std::vector<std::string>& images, const std::string& inputPath)
     return images.size();
 }
 
+std::string& PathStream::slot(const std::unique_ptr<std::string[]>* blocks, size_t index)
+{
+    size_t biased = index + (size_t(1) << FIRST_BLOCK_BITS);
+    int top = 63 - __builtin_clzll(biased);
+    return blocks[top - FIRST_BLOCK_BITS][biased - (size_t(1) << top)];
+}
+
+void PathStream::push(std::string&& path)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t index = count.load(std::memory_order_relaxed);
+        size_t biased = index + (size_t(1) << FIRST_BLOCK_BITS);
+        int top = 63 - __builtin_clzll(biased);
+        if (biased == (size_t(1) << top)) blocks[top - FIRST_BLOCK_BITS].reset(new std::string[size_t(1) << top]);
+
+        slot(blocks, index) = std::move(path);
+        count.store(index + 1, std::memory_order_release); // publishes the path to lock-free readers
+        wake = waiting > 0;
+    }
+    if (wake) grown.notify_all();
+}
+
+void PathStream::finish(bool byPath)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sortByPath = byPath;
+        done.store(true, std::memory_order_release);
+    }
+    grown.notify_all();
+}
+
+bool PathStream::wait(size_t index) const
+{
+    if (index < count.load(std::memory_order_acquire)) return true;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting++;
+    grown.wait(lock, [this, index] { return index < count.load(std::memory_order_relaxed) || done.load(std::memory_order_relaxed); });
+    waiting--;
+    return index < count.load(std::memory_order_relaxed);
+}
+
+const std::string& PathStream::at(size_t index) const
+{
+    return slot(blocks, index);
+}
+
+std::vector<size_t> PathStream::outputOrder() const
+{
+    std::vector<size_t> order(size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    if (sortByPath) {
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return at(a) < at(b); });
+    }
+    return order;
+}
+
+std::thread streamImages(PathStream& stream, const std::string& inputPath, const std::string& snapshotPath, ScanChanges* changes,
+                         bool followLinks)
+{
+    return std::thread([&stream, inputPath, snapshotPath, changes, followLinks]() {
+        bool byPath = false; // folder scans arrive in thread timing order, lists keep theirs
+        if (inputPath == "-") {
+            // find -print0 style lists, taken as they are apart from the extension filter
+            std::string path;
+            while (std::getline(std::cin, path, '\0')) {
+                if (!path.empty() && isSupportedFormat(path)) stream.push(std::move(path));
+            }
+        }
+        else if (std::filesystem::is_regular_file(inputPath)) {
+            stream.push(std::string(inputPath));
+        }
+        else if (std::filesystem::is_directory(inputPath)) {
+            DirectoryScanner scanner(0, followLinks);
+            scanIncremental(scanner, inputPath, [&stream](std::string&& path, int) { stream.push(std::move(path)); }, snapshotPath, changes);
+            byPath = true;
+        }
+        stream.finish(byPath);
+    });
+}
+
+void processStreamed(PathStream& stream, const std::string& inputPath, const BatchOptions& options, const std::function<void()>& process)
+{
+    ScanChanges changes;
+    std::thread scanner = streamImages(stream, inputPath, options.snapshot, &changes, options.followLinks);
+    process();
+    scanner.join();
+    if (!options.snapshot.empty()) { printScanChanges(changes); }
+}
+
+static bool probeJpegSize(const unsigned char* data, size_t size, ImageHeader& header)
+{
+    size_t pos = 2; // skip SOI
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        while (pos < size && data[pos] == 0xFF) pos++; // fill bytes
+        if (pos >= size) return false;
+
+        unsigned char marker = data[pos++];
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) continue; // standalone markers
+        if (marker == 0xD9 || marker == 0xDA) return false;                  // EOI/SOS before any SOF
+        if (pos + 2 > size) return false;
+
+        uint16_t length = readBE16(data + pos);
+        bool isSof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (isSof) {
+            if (pos + 7 > size) return false;
+            header.height = readBE16(data + pos + 3);
+            header.width = readBE16(data + pos + 5);
+            return true;
+        }
+        pos += length;
+    }
+    return false;
+}
+
+bool probeImageHeader(const unsigned char* data, size_t size, ImageHeader& header)
+{
+    header = ImageHeader();
+    if (size < 12) return false;
+
+    if (data[0] == 0xFF && data[1] == 0xD8) {
+        header.format = ImageFormat::JPEG;
+        return probeJpegSize(data, size, header);
+    }
+
+    if (std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        header.format = ImageFormat::PNG;
+        if (size < 24 || std::memcmp(data + 12, "IHDR", 4) != 0) return false;
+        header.width = readBE32(data + 16);
+        header.height = readBE32(data + 20);
+        return true;
+    }
+
+    if (std::memcmp(data, "GIF87a", 6) == 0 || std::memcmp(data, "GIF89a", 6) == 0) {
+        header.format = ImageFormat::GIF;
+        header.width = readLE16(data + 6);
+        header.height = readLE16(data + 8);
+        return true;
+    }
+
+    if (data[0] == 'B' && data[1] == 'M') {
+        header.format = ImageFormat::BMP;
+        if (size < 26) return false;
+        if (readLE32(data + 14) == 12) { // OS/2 BITMAPCOREHEADER
+            header.width = readLE16(data + 18);
+            header.height = readLE16(data + 20);
+        }
+        else {
+            header.width = (int32_t)readLE32(data + 18);
+            header.height = std::abs((int32_t)readLE32(data + 22)); // negative = top-down
+        }
+        return true;
+    }
+
+    if (std::memcmp(data, "RIFF", 4) == 0 && std::memcmp(data + 8, "WEBP", 4) == 0) {
+        header.format = ImageFormat::WEBP;
+        if (size < 30) return false;
+        const unsigned char* chunk = data + 12;
+        if (std::memcmp(chunk, "VP8 ", 4) == 0) {
+            header.width = readLE16(data + 26) & 0x3FFF;
+            header.height = readLE16(data + 28) & 0x3FFF;
+            return true;
+        }
+        if (std::memcmp(chunk, "VP8L", 4) == 0) {
+            uint32_t bits = readLE32(data + 21);
+            header.width = (bits & 0x3FFF) + 1;
+            header.height = ((bits >> 14) & 0x3FFF) + 1;
+            return true;
+        }
+        if (std::memcmp(chunk, "VP8X", 4) == 0) {
+            header.width = (data[24] | (data[25] << 8) | (data[26] << 16)) + 1;
+            header.height = (data[27] | (data[28] << 8) | (data[29] << 16)) + 1;
+            return true;
+        }
+        return false;
+    }
+
+    if (std::memcmp(data, "II*\0", 4) == 0 || std::memcmp(data, "MM\0*", 4) == 0) {
+        header.format = ImageFormat::TIFF;
+        return false; // dimensions live in the IFD, not worth walking here
+    }
+
+    return false;
+}
+
+bool probeImageHeader(const std::string& path, ImageHeader& header)
+{
+    // large enough to get past EXIF/XMP/ICC segments in front of the JPEG SOF
+    constexpr size_t headSize = 256 * 1024;
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        header = ImageHeader();
+        return false;
+    }
+
+    std::vector<unsigned char> head(headSize);
+    file.read(reinterpret_cast<char*>(head.data()), headSize);
+    return probeImageHeader(head.data(), static_cast<size_t>(file.gcount()), header);
+}
+
+LoadMode loadMode = LoadMode::AUTO;
+
+FileBuffer& FileBuffer::operator=(FileBuffer&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        mapping = other.mapping;
+        length = other.length;
+        buffer = std::move(other.buffer);
+        other.mapping = nullptr;
+        other.length = 0;
+    }
+    return *this;
+}
+
+void FileBuffer::release()
+{
+    if (mapping) munmap(mapping, length);
+    mapping = nullptr;
+    length = 0;
+    buffer.clear();
+}
+
+bool FileBuffer::load(const std::string& path, LoadMode mode)
+{
+    release();
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+
+    bool useMmap = size > 0 && (mode == LoadMode::MMAP || (mode == LoadMode::AUTO && size >= MMAP_THRESHOLD));
+    if (useMmap) {
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, size, MADV_SEQUENTIAL);
+            mapping = static_cast<unsigned char*>(p);
+            length = size;
+            close(fd);
+            return true;
+        }
+        // fall through to read(), e.g. files on filesystems without mmap support
+    }
+
+    buffer.resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buffer.data() + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    close(fd);
+
+    if (done != size) {
+        buffer.clear();
+        return false;
+    }
+    length = size;
+    return true;
+}
+
+cv::Mat decodeImage(const std::string& path, const FileBuffer* file, int flags)
+{
+    FileBuffer own;
+    if (file == nullptr) {
+        if (loadMode == LoadMode::IMREAD) return cv::imread(path, flags);
+        if (!own.load(path)) return cv::Mat();
+        file = &own;
+    }
+    // a 1xN Mat has an int width, imdecode could not take a larger file anyway
+    if (file->size() == 0 || file->size() > static_cast<size_t>(std::numeric_limits<int>::max())) return cv::Mat();
+
+    // Mat header over the bytes, imdecode reads them in place
+    cv::Mat raw(1, static_cast<int>(file->size()), CV_8UC1, const_cast<unsigned char*>(file->data()));
+    return cv::imdecode(raw, flags);
+}
+
+cv::Mat decodeImage(const std::string& path, const FileBuffer* file)
+{
+    return decodeImage(path, file, cv::IMREAD_COLOR);
+}
+
+long peakRssKb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss; // kilobytes on linux
+}
+
+bool getFileId(const std::string& path, FileId& id)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    id.size = st.st_size;
+    id.mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// 64-bit multiply/xorshift hash over 8-byte words, good enough to recognise renamed/copied files.
+// Chunks must be whole words except the last one, then chunked and single calls give the same hash
+static constexpr uint64_t HASH_PRIME = 0x9E3779B97F4A7C15ull;
+static constexpr uint64_t HASH_SEED = 0xCBF29CE484222325ull;
+
+static uint64_t hashChunk(uint64_t hash, const unsigned char* data, size_t n)
+{
+    size_t words = n / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t w;
+        std::memcpy(&w, data + i * 8, 8);
+        hash = (hash ^ w) * HASH_PRIME;
+        hash ^= hash >> 29;
+    }
+    for (size_t i = words * 8; i < n; i++) {
+        hash = (hash ^ data[i]) * HASH_PRIME;
+    }
+    return hash;
+}
+
+uint64_t hashBytes(const unsigned char* data, size_t size)
+{
+    uint64_t hash = hashChunk(HASH_SEED, data, size);
+    return hash ^ (hash >> 32);
+}
+
+uint64_t hashFileContents(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return 0;
+
+    uint64_t hash = HASH_SEED;
+    std::vector<char> buffer(1 << 20);
+
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        hash = hashChunk(hash, reinterpret_cast<const unsigned char*>(buffer.data()), static_cast<size_t>(file.gcount()));
+    }
+
+    return hash ^ (hash >> 32);
+}
+
+int defaultThreadCount()
+{
+    int numThreads = std::thread::hardware_concurrency();
+    if (numThreads == 0) numThreads = 4; // Fallback in case detection fails
+    return numThreads;
+}
+
+std::vector<ThreadStats> parallelFor(size_t count, int numThreads, const std::function<void(size_t, int)>& fn)
+{
+    if (numThreads <= 0) numThreads = defaultThreadCount();
+    numThreads = static_cast<int>(std::min<size_t>(numThreads, std::max<size_t>(count, 1)));
+    return parallelFor([count](size_t i) { return i < count; }, numThreads, fn);
+}
+
+std::vector<ThreadStats> parallelFor(const std::function<bool(size_t)>& available, int numThreads, const std::function<void(size_t, int)>& fn)
+{
+    using clock = std::chrono::steady_clock;
+
+    if (numThreads <= 0) numThreads = defaultThreadCount();
+
+    // one index at a time: per-file work is milliseconds, so the shared counter never contends,
+    // and a folder of huge files gets spread over every thread instead of landing in one chunk
+    std::atomic<size_t> next{0};
+    std::vector<ThreadStats> stats(numThreads);
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads);
+
+    auto start = clock::now();
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            ThreadStats& own = stats[t];
+            for (size_t i = next++; available(i); i = next++) {
+                auto itemStart = clock::now();
+                fn(i, t);
+                own.busySeconds += std::chrono::duration<double>(clock::now() - itemStart).count();
+                own.items++;
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    double wall = std::chrono::duration<double>(clock::now() - start).count();
+    for (auto& own : stats) {
+        own.idleSeconds = std::max(0.0, wall - own.busySeconds);
+    }
+
+    return stats;
+}
+
+void printThreadStats(const std::vector<ThreadStats>& stats)
+{
+    std::cout << "\nThread   items      busy      idle" << std::endl;
+    for (size_t t = 0; t < stats.size(); t++) {
+        std::cout << std::setw(6) << t << std::setw(8) << stats[t].items
+                  << std::fixed << std::setprecision(2)
+                  << std::setw(9) << stats[t].busySeconds << "s"
+                  << std::setw(9) << stats[t].idleSeconds << "s" << std::endl;
+    }
+}
+
+ShardedCounters::ShardedCounters(int shards, size_t counters)
+    : shards(std::max(shards, 1)), counters(counters),
+      stride((counters + 7) / 8 * 8 + 8), // at least one cache line between the used part of two rows
+      values(new std::atomic<size_t>[this->shards * stride])
+{
+    for (size_t i = 0; i < this->shards * stride; i++) values[i].store(0, std::memory_order_relaxed);
+}
+
+size_t ShardedCounters::sum(size_t counter) const
+{
+    size_t total = 0;
+    for (int s = 0; s < shards; s++) total += values[s * stride + counter].load(std::memory_order_relaxed);
+    return total;
+}
+
+static void printProgress(const std::atomic<bool>& running, size_t total, const PathStream* stream, const ShardedCounters& processed,
+                          const ShardedCounters& counters, const BatchOptions& options)
+{
+    std::chrono::steady_clock::time_point prev_time = std::chrono::steady_clock::now();
+    size_t prev_processed = 0;
+
+    // Moving average for i/s calculation
+    std::vector<double> speed_samples;
+    const size_t max_samples = 10; // Average over last 10 samples
+    float top_speed = 0.0f;
+
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+        size_t current = processed.sum(0);
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> time_delta = now - prev_time;
+
+        // Calculate instantaneous speed
+        double instant_speed = 0.0;
+        if (time_delta.count() > 0) {
+            instant_speed = (current - prev_processed) / time_delta.count();
+        }
+
+        // Add to moving average (only if we processed some)
+        if (current > prev_processed) {
+            speed_samples.push_back(instant_speed);
+            if (speed_samples.size() > max_samples) {
+                speed_samples.erase(speed_samples.begin());
+            }
+        }
+
+        // Calculate averaged speed
+        double avg_speed = 0.0;
+        if (!speed_samples.empty()) {
+            double sum = 0.0;
+            for (double speed : speed_samples) {
+                sum += speed;
+            }
+            avg_speed = sum / speed_samples.size();
+        }
+
+        prev_time = now;
+        prev_processed = current;
+
+        // while the scanner is still walking, the total so far is only a lower bound: no percentage or ETA yet
+        bool scanning = stream && !stream->finished();
+        if (stream) total = stream->size();
+
+        float p = total > 0 ? static_cast<float>(current) / static_cast<float>(total) : 0.0f;
+
+        // Calculate ETA
+        std::string eta_str = "";
+        if (avg_speed > 0 && current < total && !scanning) {
+            double remaining_time = (total - current) / avg_speed;
+            eta_str = " ETA: " + formatTime(static_cast<int>(remaining_time));
+        }
+
+        if (avg_speed > top_speed) top_speed = avg_speed;
+
+        if (options.table) {
+            Cursor::reset();
+            options.table(std::cout, counters);
+            std::cout << std::endl;
+        }
+        else {
+            Cursor::cr();
+        }
+
+        std::cout << "==: " << current << "/" << total << (options.label ? options.label(counters) : "") << " "
+                  << std::fixed << std::setprecision(1);
+        if (scanning) { std::cout << "(processed/scanned, scanning...)"; }
+        else { std::cout << p * 100 << "%"; }
+        std::cout << " (avg: " << std::setprecision(1) << avg_speed << " i/s)" << " (top: " << top_speed << " i/s)"
+                  << eta_str << "               ";
+        if (options.table) { std::cout << std::endl; }
+        std::cout.flush();
+    }
+    std::cout << std::endl;
+}
+
+struct LoadedFile {
+    size_t index = 0;
+    bool ok = false;
+    FileBuffer file;
+};
+
+// readers pull indices and load whole files into a bounded queue, compute threads decode and analyse
+// from memory; results still go straight into the per-index slots, so the writer stage needs no queue
+static void runPipeline(const std::function<bool(size_t)>& available, int numThreads, const BatchOptions& options, ShardedCounters& processed,
+                        ShardedCounters& counters, const std::function<void(size_t, BatchContext&)>& fn, BatchReport& report)
+{
+    using clock = std::chrono::steady_clock;
+
+    size_t depth = options.queueDepth > 0 ? options.queueDepth : 2 * numThreads;
+    BoundedQueue<LoadedFile> queue(depth);
+
+    std::atomic<int> activeReaders{options.readers};
+    std::vector<std::thread> readers;
+    report.readers.resize(options.readers);
+    auto start = clock::now();
+
+    std::atomic<size_t> next{0};
+    for (int r = 0; r < options.readers; r++) {
+        readers.emplace_back([&, r]() {
+            ThreadStats& own = report.readers[r];
+            for (size_t i = next++; available(i); i = next++) {
+                auto itemStart = clock::now();
+                LoadedFile file;
+                file.index = i;
+                std::string path = options.pathOf(i);
+                if (!options.needed || options.needed(path)) {
+                    file.ok = file.file.load(path, loadMode == LoadMode::IMREAD ? LoadMode::AUTO : loadMode);
+                }
+                own.busySeconds += std::chrono::duration<double>(clock::now() - itemStart).count();
+                own.items++;
+                if (!queue.push(std::move(file))) break;
+            }
+            if (--activeReaders == 0) queue.close();
+        });
+    }
+
+    std::vector<std::thread> workers;
+    report.threads.resize(numThreads);
+    for (int t = 0; t < numThreads; t++) {
+        workers.emplace_back([&, t]() {
+            ThreadStats& own = report.threads[t];
+            LoadedFile file;
+            while (queue.pop(file)) {
+                auto itemStart = clock::now();
+                BatchContext ctx{t, counters};
+                ctx.file = file.ok ? &file.file : nullptr; // unread files and read errors fall back to the tool's own loading
+                fn(file.index, ctx);
+                processed.add(t, 0);
+                own.busySeconds += std::chrono::duration<double>(clock::now() - itemStart).count();
+                own.items++;
+            }
+        });
+    }
+
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double wall = std::chrono::duration<double>(clock::now() - start).count();
+    for (auto& own : report.threads) {
+        own.idleSeconds = std::max(0.0, wall - own.busySeconds);
+    }
+    for (auto& own : report.readers) {
+        own.idleSeconds = std::max(0.0, wall - own.busySeconds);
+    }
+    report.readQueue = queue.stats();
+}
+
+Prefetcher::Prefetcher(std::function<bool(size_t)> available, std::function<std::string(size_t)> pathOf,
+                       std::function<bool(const std::string&)> needed, size_t window, size_t budgetBytes)
+    : available(std::move(available)), pathOf(std::move(pathOf)), needed(std::move(needed)), window(std::max<size_t>(window, 1)),
+      budgetBytes(budgetBytes)
+{
+    thread = std::thread(&Prefetcher::run, this);
+}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+}
+
+void Prefetcher::done(size_t index)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = hinted.find(index);
+        if (it != hinted.end()) {
+            inflightBytes -= it->second;
+            hinted.erase(it);
+        }
+        else if (skipped.erase(index) == 0) {
+            missed++;
+            if (index >= cursor) overtaken.insert(index); // no point hinting it later
+        }
+        completed++;
+    }
+    wake.notify_one();
+}
+
+void Prefetcher::run()
+{
+    // workers take indices in order, so "ahead - completed" is the number of files in flight
+    for (size_t ahead = 0; available(ahead); ahead++) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this, ahead] {
+                return stopping || (ahead < completed + window && inflightBytes < budgetBytes);
+            });
+            if (stopping) return;
+            cursor = ahead;
+            if (overtaken.erase(ahead) > 0) {
+                cursor = ahead + 1;
+                continue;
+            }
+        }
+
+        std::string path = pathOf(ahead);
+        if (needed && !needed(path)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cursor = ahead + 1;
+            if (overtaken.erase(ahead) == 0) skipped.insert(ahead);
+            continue;
+        }
+
+        uint64_t size = 0;
+        bool ok = false;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                size = st.st_size;
+                ok = true;
+            }
+            close(fd);
+        }
+
+        // a worker may have finished the file while we were opening it
+        std::lock_guard<std::mutex> lock(mutex);
+        cursor = ahead + 1;
+        if (overtaken.erase(ahead) == 0 && ok) {
+            hinted[ahead] = size;
+            inflightBytes += size;
+            prefetched++;
+        }
+    }
+}
+
+void printQueueStats(const std::string& name, const QueueStats& stats)
+{
+    double avg = stats.pushes > 0 ? stats.occupancySum / stats.pushes : 0.0;
+    std::cout << name << ": avg " << std::fixed << std::setprecision(1) << avg << "/" << stats.capacity
+              << ", max " << stats.maxOccupancy << "/" << stats.capacity
+              << ", full " << stats.fullWaits << "x (" << std::setprecision(2) << stats.fullWaitSeconds << "s)"
+              << ", empty " << stats.emptyWaits << "x (" << stats.emptyWaitSeconds << "s)" << std::endl;
+}
+
+void addBatchArguments(argparse::ArgumentParser& program)
+{
+    program.add_argument("-t", "--threads")
+        .help("compute threads (decode + analysis), 0 = one per core")
+        .default_value(0)
+        .scan<'i', int>();
+    program.add_argument("--readers")
+        .help("pipeline mode: threads that read files ahead into memory, 0 = off (every thread reads its own files)")
+        .default_value(0)
+        .scan<'i', int>();
+    program.add_argument("--queue")
+        .help("files buffered between readers and compute threads, 0 = 2 per compute thread")
+        .default_value(0)
+        .scan<'i', int>();
+    program.add_argument("--prefetch")
+        .help("ask the kernel to read this many upcoming files ahead (posix_fadvise WILLNEED), 0 = off")
+        .default_value(0)
+        .scan<'i', int>();
+    program.add_argument("--loader")
+        .help("how files are read: auto (mmap >= 160KB, read() below), mmap, read, imread (OpenCV's own I/O)")
+        .default_value(std::string("auto"))
+        .metavar("auto/mmap/read/imread");
+    program.add_argument("--prefetch-mb")
+        .help("upper bound on prefetched but not yet processed data")
+        .default_value(512)
+        .scan<'i', int>();
+    program.add_argument("--follow-links")
+        .help("also walk symlinked folders (after the real tree, so a folder reachable both ways keeps its real path)")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--snapshot")
+        .help("remember folder mtimes and contents in this file, later scans only read folders that changed")
+        .default_value(std::string(""))
+        .metavar("scan.bin");
+}
+
+BatchOptions batchOptionsFromArguments(const argparse::ArgumentParser& program)
+{
+    BatchOptions options;
+    options.threads = std::max(0, program.get<int>("--threads"));
+    options.readers = std::max(0, program.get<int>("--readers"));
+    options.queueDepth = std::max(0, program.get<int>("--queue"));
+    options.prefetch = std::max(0, program.get<int>("--prefetch"));
+    options.prefetchBudgetMb = std::max(1, program.get<int>("--prefetch-mb"));
+    options.snapshot = program.get<std::string>("--snapshot");
+    options.followLinks = program.get<bool>("--follow-links");
+
+    std::string loader = program.get<std::string>("--loader");
+    if      (loader == "mmap")   { loadMode = LoadMode::MMAP; }
+    else if (loader == "read")   { loadMode = LoadMode::READ; }
+    else if (loader == "imread") { loadMode = LoadMode::IMREAD; }
+    else                         { loadMode = LoadMode::AUTO; }
+    return options;
+}
+
+int batchThreadCount(const BatchOptions& options)
+{
+    return options.threads > 0 ? options.threads : defaultThreadCount();
+}
+
+// stream == nullptr: total fixed up front, otherwise the stream decides when the input ends
+static BatchReport runBatch(size_t total, const PathStream* stream, BatchOptions options, const std::function<void(size_t, BatchContext&)>& fn)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    int numThreads = batchThreadCount(options);
+    std::cout << "Using " << numThreads << " threads for processing." << std::endl;
+
+    std::function<bool(size_t)> available = [total](size_t i) { return i < total; };
+    if (stream) {
+        available = [stream](size_t i) { return stream->wait(i); };
+        if (!options.pathOf) options.pathOf = [stream](size_t i) { return stream->at(i); };
+    }
+
+    ShardedCounters processed(numThreads, 1);
+    ShardedCounters counters(numThreads, options.counters);
+    std::atomic<bool> running = true;
+
+    if (options.table) {
+        Cursor::hide();
+        Cursor::termClear();
+    }
+
+    std::thread printThread(printProgress, std::cref(running), total, stream, std::cref(processed), std::cref(counters), std::cref(options));
+
+    std::unique_ptr<Prefetcher> prefetcher;
+    if (options.prefetch > 0 && options.pathOf) {
+        prefetcher.reset(new Prefetcher(available, options.pathOf, options.needed, options.prefetch, options.prefetchBudgetMb << 20));
+    }
+    auto work = [&fn, &prefetcher](size_t i, BatchContext& ctx) {
+        fn(i, ctx);
+        if (prefetcher) prefetcher->done(i);
+    };
+
+    BatchReport report;
+    if (options.readers > 0 && options.pathOf) {
+        runPipeline(available, numThreads, options, processed, counters, work, report);
+    }
+    else {
+        report.threads = parallelFor(available, stream ? numThreads : std::min<size_t>(numThreads, std::max<size_t>(total, 1)),
+                                     [&](size_t i, int threadId) {
+                                         BatchContext ctx{threadId, counters};
+                                         work(i, ctx);
+                                         processed.add(threadId, 0);
+                                     });
+    }
+    // stop print thread
+    running = false;
+    printThread.join();
+
+    report.total = stream ? stream->size() : total;
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    for (size_t c = 0; c < counters.size(); c++) report.counters.push_back(counters.sum(c));
+
+    std::cout << "\nCompleted in " << static_cast<long>(report.seconds * 1000) << "ms" << std::endl;
+    std::cout << "Average: " << std::fixed << std::setprecision(2)
+              << (report.total > 0 ? report.seconds * 1000 / report.total : 0.0) << "ms per image" << std::endl;
+    printThreadStats(report.threads);
+    if (!report.readers.empty()) {
+        std::cout << "\nReaders:";
+        printThreadStats(report.readers);
+        printQueueStats("Read queue", report.readQueue);
+    }
+    if (prefetcher) {
+        std::cout << "Prefetch: " << prefetcher->early() << " files hinted ahead, " << prefetcher->late() << " reached by a worker first" << std::endl;
+    }
+
+    return report;
+}
+
+BatchReport runBatch(size_t total, const BatchOptions& options, const std::function<void(size_t, BatchContext&)>& fn)
+{
+    return runBatch(total, nullptr, options, fn);
+}
+
+BatchReport runBatch(const PathStream& paths, const BatchOptions& options, const std::function<void(size_t, BatchContext&)>& fn)
+{
+    return runBatch(0, &paths, options, fn);
+}
+
 std::string formatTime(int seconds)
 {
     int hours = seconds / 3600;
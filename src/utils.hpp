@@ -1,13 +1,397 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+struct ScanChanges;
+
+// only the declarations below need these, the tools that use them include the full headers
+namespace argparse {
+    class ArgumentParser;
+}
+namespace cv {
+    class Mat;
+}
+
 extern std::vector<std::string> supportedExtensions;
 bool isSupportedFormat(const std::string& filename);
-size_t scanFolder(std::vector<std::string>& imageFiles, const std::string& folderPath);
+// snapshotPath: read the previous scan from it (only changed folders are read again) and replace it with this one
+// followLinks: also walk symlinked folders, see DirectoryScanner
+size_t scanFolder(std::vector<std::string>& imageFiles, const std::string& folderPath, const std::string& snapshotPath = "",
+                  ScanChanges* changes = nullptr, bool followLinks = false);
+void printScanChanges(const ScanChanges& changes);
 std::string formatTime(int seconds);
 size_t getImages(std::vector<std::string>& images, const std::string& inputPath);
 
+enum class ImageFormat {
+    UNKNOWN,
+    JPEG,
+    PNG,
+    GIF,
+    BMP,
+    WEBP,
+    TIFF
+};
+
+struct ImageHeader {
+    ImageFormat format = ImageFormat::UNKNOWN;
+    int width = 0;
+    int height = 0;
+};
+
+inline uint16_t readBE16(const unsigned char* p) { return (p[0] << 8) | p[1]; }
+inline uint16_t readLE16(const unsigned char* p) { return p[0] | (p[1] << 8); }
+inline uint32_t readBE32(const unsigned char* p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+inline uint32_t readLE32(const unsigned char* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+// read format and dimensions from the container header without decoding pixels
+bool probeImageHeader(const unsigned char* data, size_t size, ImageHeader& header);
+bool probeImageHeader(const std::string& path, ImageHeader& header);
+long peakRssKb();
+enum class LoadMode {
+    AUTO,  // mmap large files, read() small ones
+    MMAP,
+    READ,
+    IMREAD // let OpenCV open the file itself (no structural checks share the bytes)
+};
+
+extern LoadMode loadMode;
+// below this mmap setup + teardown costs more than a read() copy: `make bench` times both, in the page cache read()
+// won up to 128 KB and mmap from 160 KB on
+constexpr size_t MMAP_THRESHOLD = 160 * 1024;
+
+// Whole file contents, either mapped (MAP_POPULATE + MADV_SEQUENTIAL) or read into a buffer.
+// The bytes are handed to imdecode and the structure checks as-is, nothing is copied again.
+// A mapped file that another process truncates while it is in use raises SIGBUS on the next access
+// past the new end; LoadMode::READ is the safe choice for trees that are rewritten during a run.
+class FileBuffer {
+  public:
+    FileBuffer() = default;
+    FileBuffer(const FileBuffer&) = delete;
+    FileBuffer& operator=(const FileBuffer&) = delete;
+    FileBuffer(FileBuffer&& other) noexcept { *this = std::move(other); }
+    FileBuffer& operator=(FileBuffer&& other) noexcept;
+    ~FileBuffer() { release(); }
+
+    bool load(const std::string& path, LoadMode mode = loadMode);
+    const unsigned char* data() const { return mapping ? mapping : buffer.data(); }
+    size_t size() const { return length; }
+    bool mapped() const { return mapping != nullptr; }
+
+  private:
+    unsigned char* mapping = nullptr;
+    size_t length = 0;
+    std::vector<unsigned char> buffer;
+
+    void release();
+};
+
+// imdecode the buffer when there is one, otherwise load the file first (or imread in IMREAD mode)
+cv::Mat decodeImage(const std::string& path, const FileBuffer* file, int flags);
+cv::Mat decodeImage(const std::string& path, const FileBuffer* file); // cv::IMREAD_COLOR
+
+// identity of a file on disk, if any of these change the contents may have changed
+struct FileId {
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+
+    bool operator==(const FileId& o) const { return dev == o.dev && ino == o.ino && size == o.size && mtimeNs == o.mtimeNs; }
+    bool operator<(const FileId& o) const
+    {
+        if (dev != o.dev) return dev < o.dev;
+        if (ino != o.ino) return ino < o.ino;
+        if (size != o.size) return size < o.size;
+        return mtimeNs < o.mtimeNs;
+    }
+};
+
+struct FileIdHash {
+    size_t operator()(const FileId& id) const { return (id.dev * 0x9E3779B97F4A7C15ull) ^ (id.ino * 0xC2B2AE3D27D4EB4Full) ^ id.size ^ (uint64_t)id.mtimeNs; }
+};
+
+bool getFileId(const std::string& path, FileId& id);
+uint64_t hashFileContents(const std::string& path);
+uint64_t hashBytes(const unsigned char* data, size_t size); // same hash as hashFileContents over these bytes
+
+struct ThreadStats {
+    size_t items = 0;
+    double busySeconds = 0.0;
+    double idleSeconds = 0.0;
+};
+
+int defaultThreadCount();
+// runs fn(index, threadId) for every index in [0, count), threads pull the next index from a shared counter
+std::vector<ThreadStats> parallelFor(size_t count, int numThreads, const std::function<void(size_t, int)>& fn);
+// same, for inputs that are still arriving: available(index) blocks until index exists, false ends the loop
+std::vector<ThreadStats> parallelFor(const std::function<bool(size_t)>& available, int numThreads, const std::function<void(size_t, int)>& fn);
+void printThreadStats(const std::vector<ThreadStats>& stats);
+
+// one row of counters per thread, each row on its own cache lines; writers never share a line,
+// the progress reporter sums the rows
+class ShardedCounters {
+  public:
+    ShardedCounters(int shards, size_t counters);
+    void add(int shard, size_t counter, size_t n = 1) { values[shard * stride + counter].fetch_add(n, std::memory_order_relaxed); }
+    size_t sum(size_t counter) const;
+    size_t size() const { return counters; }
+
+  private:
+    int shards;
+    size_t counters;
+    size_t stride;
+    std::unique_ptr<std::atomic<size_t>[]> values;
+};
+
+struct QueueStats {
+    size_t capacity = 0;
+    size_t pushes = 0;
+    size_t maxOccupancy = 0;
+    double occupancySum = 0.0; // sampled after every push
+    size_t fullWaits = 0;      // producer found the queue full
+    size_t emptyWaits = 0;     // consumer found the queue empty
+    double fullWaitSeconds = 0.0;
+    double emptyWaitSeconds = 0.0;
+};
+
+// blocking multi-producer/multi-consumer queue with a fixed capacity, records how full it ran
+template <typename T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity) { statistics.capacity = std::max<size_t>(capacity, 1); }
+
+    // false once the queue is closed
+    bool push(T&& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.size() >= statistics.capacity && !closed) {
+            auto waitStart = std::chrono::steady_clock::now();
+            notFull.wait(lock, [this] { return items.size() < statistics.capacity || closed; });
+            statistics.fullWaits++;
+            statistics.fullWaitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+        }
+        if (closed) return false;
+
+        items.push_back(std::move(item));
+        statistics.pushes++;
+        statistics.occupancySum += items.size();
+        statistics.maxOccupancy = std::max(statistics.maxOccupancy, items.size());
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // false once the queue is closed and drained
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.empty() && !closed) {
+            auto waitStart = std::chrono::steady_clock::now();
+            notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+            statistics.emptyWaits++;
+            statistics.emptyWaitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+        }
+        if (items.empty()) return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+    QueueStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return statistics;
+    }
+
+  private:
+    mutable std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<T> items;
+    bool closed = false;
+    QueueStats statistics;
+};
+
+void printQueueStats(const std::string& name, const QueueStats& stats);
+
+// Paths found by a scanner while the workers already run. Append-only, so an index names the same path
+// for the whole run and results can still be stored by index. Paths live in blocks that double in size
+// and never move: a path below the published count is read without the lock.
+class PathStream {
+  public:
+    void push(std::string&& path);   // from any number of producer threads
+    void finish(bool byPath = false); // no more paths will be pushed; byPath: outputOrder() sorts by path
+
+    bool wait(size_t index) const; // blocks until index exists, false when the stream finished before it
+    const std::string& at(size_t index) const; // index must exist (wait returned true)
+    size_t size() const { return count.load(std::memory_order_acquire); }
+    bool finished() const { return done.load(std::memory_order_acquire); }
+
+    // after finish(): indices in the order results are written. A folder scan arrives in thread timing order
+    // and is sorted by path like scanFolder; stdin lists keep their own order
+    std::vector<size_t> outputOrder() const;
+
+  private:
+    static constexpr int FIRST_BLOCK_BITS = 10; // block b holds 2^(b + 10) paths
+    static constexpr int BLOCKS = 64 - FIRST_BLOCK_BITS;
+
+    static std::string& slot(const std::unique_ptr<std::string[]>* blocks, size_t index);
+
+    std::unique_ptr<std::string[]> blocks[BLOCKS];
+    std::atomic<size_t> count{0};
+    std::atomic<bool> done{false};
+    bool sortByPath = false;
+
+    mutable std::mutex mutex;
+    mutable std::condition_variable grown;
+    mutable size_t waiting = 0; // consumers blocked in wait(), producers only notify when there are any
+};
+
+// fills stream from a folder scan, a single file, or NUL-delimited paths on stdin ("-"), then finishes it
+std::thread streamImages(PathStream& stream, const std::string& inputPath, const std::string& snapshotPath = "",
+                         ScanChanges* changes = nullptr, bool followLinks = false);
+
+// Keeps a window of upcoming files in flight in the page cache with posix_fadvise(WILLNEED), which
+// queues asynchronous readahead and returns, so by the time a worker opens a file its bytes are in memory.
+// The window is bounded both in files and in bytes not yet consumed.
+class Prefetcher {
+  public:
+    // available(index) as for parallelFor, lets the window follow a PathStream that is still growing;
+    // needed as in BatchOptions, files it rejects are not hinted (empty = all)
+    Prefetcher(std::function<bool(size_t)> available, std::function<std::string(size_t)> pathOf,
+               std::function<bool(const std::string&)> needed, size_t window, size_t budgetBytes);
+    ~Prefetcher();
+    void done(size_t index); // worker finished with a file, frees its share of the budget
+
+    size_t early() const { return prefetched; } // hinted before a worker needed it
+    size_t late() const { return missed; }      // a worker got there first
+
+  private:
+    std::function<bool(size_t)> available;
+    std::function<std::string(size_t)> pathOf;
+    std::function<bool(const std::string&)> needed;
+    size_t window;
+    size_t budgetBytes;
+
+    // guarded by mutex: files hinted but not yet done (index -> size), files a worker finished before the hint
+    std::unordered_map<size_t, uint64_t> hinted;
+    std::unordered_set<size_t> overtaken;
+    std::unordered_set<size_t> skipped; // not needed, passed over without a hint
+    size_t cursor = 0; // next index the prefetch thread will look at
+    size_t completed = 0;
+    uint64_t inflightBytes = 0;
+    std::atomic<size_t> prefetched{0};
+    std::atomic<size_t> missed{0};
+    bool stopping = false;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+
+    void run();
+};
+
+struct BatchContext {
+    int threadId;
+    ShardedCounters& counters;
+    const FileBuffer* file = nullptr; // file contents when a reader stage loaded them
+    void count(size_t counter, size_t n = 1) { counters.add(threadId, counter, n); }
+};
+
+struct BatchOptions {
+    int threads = 0;       // compute threads, 0 = hardware concurrency
+    int readers = 0;       // >0: pipeline mode, this many threads read files ahead of the compute threads
+    size_t queueDepth = 0; // files buffered between readers and compute threads, 0 = 2 per compute thread
+    size_t prefetch = 0;   // files hinted to the kernel ahead of the workers, 0 = off
+    size_t prefetchBudgetMb = 512;
+    std::string snapshot;  // folder scan snapshot for incremental rescans, empty = full scan
+    bool followLinks = false; // walk symlinked folders too
+    std::function<std::string(size_t)> pathOf; // required in pipeline mode, defaults to the stream when streaming
+    // false for files the tool will not read, e.g. hits in its cache: readers hand those over unread. Empty = all
+    std::function<bool(const std::string&)> needed;
+    size_t counters = 0;   // tool specific counters, bumped through BatchContext::count
+    // grouper redraws a table above the progress line, the other tools keep a single \r line
+    std::function<void(std::ostream&, const ShardedCounters&)> table;
+    // appended after done/total on the progress line, e.g. " (bad: 3)"
+    std::function<std::string(const ShardedCounters&)> label;
+};
+
+struct BatchReport {
+    size_t total = 0; // items processed, known only at the end when streaming
+    double seconds = 0.0;
+    std::vector<ThreadStats> threads;
+    std::vector<ThreadStats> readers;
+    QueueStats readQueue;
+    std::vector<size_t> counters;
+};
+
+// --threads, --readers, --queue, --prefetch and --loader, the same on every batch tool
+void addBatchArguments(argparse::ArgumentParser& program);
+BatchOptions batchOptionsFromArguments(const argparse::ArgumentParser& program);
+
+// parallelFor + progress/speed/ETA reporting + timing summary, shared by every batch tool
+BatchReport runBatch(size_t total, const BatchOptions& options, const std::function<void(size_t, BatchContext&)>& fn);
+
+// workers start on the first paths while the scanner is still walking, the progress line shows scanned vs processed
+BatchReport runBatch(const PathStream& paths, const BatchOptions& options, const std::function<void(size_t, BatchContext&)>& fn);
+int batchThreadCount(const BatchOptions& options);
+
+// streamImages(stream, inputPath) in the background while process() runs: workers start on the first paths while
+// the rest of the tree is still being scanned. Joins the scan, then prints the snapshot changes when there is one.
+void processStreamed(PathStream& stream, const std::string& inputPath, const BatchOptions& options, const std::function<void()>& process);
+
+// results land in pre-sized slots by input index: no lock on the hot path and the output order is the input order
+template <typename Result, typename Fn>
+BatchReport processBatch(std::vector<Result>& results, size_t total, const BatchOptions& options, Fn fn)
+{
+    results.clear();
+    results.resize(total);
+    return runBatch(total, options, [&results, &fn](size_t i, BatchContext& ctx) { results[i] = fn(i, ctx); });
+}
+
+// the final count is unknown while streaming: each thread keeps its own (index, result) list, they are
+// merged into the stream's output order once it is done
+template <typename Result, typename Fn>
+BatchReport processBatch(std::vector<Result>& results, const PathStream& paths, const BatchOptions& options, Fn fn)
+{
+    std::vector<std::vector<std::pair<size_t, Result>>> perThread(batchThreadCount(options));
+    BatchReport report = runBatch(paths, options, [&perThread, &fn](size_t i, BatchContext& ctx) {
+        perThread[ctx.threadId].emplace_back(i, fn(i, ctx));
+    });
+
+    std::vector<size_t> order = paths.outputOrder();
+    std::vector<size_t> position(order.size());
+    for (size_t p = 0; p < order.size(); p++) position[order[p]] = p;
+
+    results.clear();
+    results.resize(report.total);
+    for (auto& list : perThread) {
+        for (auto& entry : list) results[position[entry.first]] = std::move(entry.second);
+    }
+    return report;
+}
+
 namespace Cursor {
     void termClear();
     void reset();
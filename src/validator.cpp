@@ -1,16 +1,13 @@
 #include <algorithm>
 #include <argparse/argparse.hpp>
-#include <atomic>
-#include <chrono>
 #include <filesystem>
-#include <iomanip>
 #include <iostream>
-#include <mutex>
+#include <map>
 #include <opencv2/opencv.hpp>
-#include <thread>
 #include <vector>
 
 #include "globals.hpp"
+#include "imagecheck.hpp"
 #include "utils.hpp"
 #include "debug.hpp"
 
@@ -18,177 +15,105 @@ struct ValidationResult {
     std::string filePath;
     std::string filename;
     bool isValid;
+    Verdict verdict;
     int width;
     int height;
 };
 
+enum VALIDATION_MODE {
+    DECODE, // full decode only (default)
+    FAST,   // container structure only, no pixels decoded
+    DEEP    // structure first, full decode for files that pass
+};
+
 std::vector<ValidationResult> results;
-std::mutex resultsMutex;
 
-std::atomic<int> corruptedCount = 0;
+size_t corruptedCount = 0;
+
+enum COUNTER {
+    CORRUPTED
+};
 
-ValidationResult validateImage(const std::string& imagePath)
+// file: contents already in memory (pipeline mode), nullptr to load them here
+ValidationResult validateImage(const std::string& imagePath, const FileBuffer* file, VALIDATION_MODE mode)
 {
     ValidationResult result;
     result.filePath = imagePath;
     result.filename = std::filesystem::path(imagePath).filename().string();
     result.isValid = false;
+    result.verdict = Verdict::OK;
     result.width = 0;
     result.height = 0;
 
-    try {
-        cv::Mat image = cv::imread(imagePath);
-        if (!image.empty()) {
-            result.isValid = true;
-            result.width = image.cols;
-            result.height = image.rows;
-        }
+    // structure check and decode share one load of the file
+    FileBuffer own;
+    if (file == nullptr && mode != DECODE) {
+        if (own.load(imagePath, loadMode == LoadMode::IMREAD ? LoadMode::AUTO : loadMode)) { file = &own; }
+        else { result.verdict = Verdict::UNREADABLE; }
     }
-    catch (const cv::Exception& e) {
-        // OpenCV exception - image is corrupted
-        result.isValid = false;
+
+    if (mode != DECODE && file) {
+        result.verdict = checkImageStructure(file->data(), file->size());
     }
-    catch (...) {
-        // Any other exception
-        result.isValid = false;
+
+    if (result.verdict == Verdict::OK && mode != FAST) {
+        try {
+            cv::Mat image = decodeImage(imagePath, file);
+            if (!image.empty()) {
+                result.width = image.cols;
+                result.height = image.rows;
+            }
+            else {
+                std::error_code ec;
+                result.verdict = std::filesystem::file_size(imagePath, ec) == 0 ? Verdict::ZERO_SIZE : Verdict::DECODE_FAILED;
+            }
+        }
+        catch (const cv::Exception& e) {
+            // OpenCV exception - image is corrupted
+            result.verdict = Verdict::DECODE_FAILED;
+        }
+        catch (...) {
+            // Any other exception
+            result.verdict = Verdict::DECODE_FAILED;
+        }
     }
 
-    if (!result.isValid) { corruptedCount++; }
+    result.isValid = result.verdict == Verdict::OK;
 
     return result;
 }
 
-void processImages(std::vector<std::string>& images)
+void processImages(const PathStream& images, VALIDATION_MODE mode, BatchOptions options)
 {
-    auto startTime = std::chrono::high_resolution_clock::now();
-
-    int numThreads = std::thread::hardware_concurrency();
-    if (numThreads == 0) numThreads = 4; // Fallback in case detection fails
-
-    std::cout << "Using " << numThreads << " threads for processing." << std::endl;
-
-    size_t totalImages = images.size();
-    size_t chunkSize = (totalImages + numThreads - 1) / numThreads;
-    std::atomic<int> processedImages{0};
-
-    std::vector<std::thread> threads;
-    threads.reserve(numThreads);
-    std::atomic<bool> running = true;
-
-    std::thread printThread([&running, &processedImages, &totalImages]() {
-        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
-        std::chrono::steady_clock::time_point prev_time = start_time;
-        size_t prev_processed = 0;
-
-        // Moving average for i/s calculation
-        std::vector<double> speed_samples;
-        const size_t max_samples = 10; // Average over last 10 samples
-        float top_speed = 0.0f;
-
-        while (running) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            {
-                size_t current = processedImages;
-                size_t corrupted = corruptedCount;
-                auto now = std::chrono::steady_clock::now();
-                std::chrono::duration<double> elapsed_time = now - start_time;
-                std::chrono::duration<double> time_delta = now - prev_time;
-
-                // Calculate instantaneous speed
-                double instant_speed = 0.0;
-                if (time_delta.count() > 0) {
-                    instant_speed = (current - prev_processed) / time_delta.count();
-                }
-
-                // Add to moving average (only if we processed some)
-                if (current > prev_processed) {
-                    speed_samples.push_back(instant_speed);
-                    if (speed_samples.size() > max_samples) {
-                        speed_samples.erase(speed_samples.begin());
-                    }
-                }
-
-                // Calculate averaged speed
-                double avg_speed = 0.0;
-                if (!speed_samples.empty()) {
-                    double sum = 0.0;
-                    for (double speed : speed_samples) {
-                        sum += speed;
-                    }
-                    avg_speed = sum / speed_samples.size();
-                }
-
-                prev_time = now;
-                prev_processed = current;
-
-                float p = static_cast<float>(current) / static_cast<float>(totalImages);
-
-                // Calculate ETA
-                std::string eta_str = "";
-                if (avg_speed > 0 && current < totalImages) {
-                    double remaining_time = (totalImages - current) / avg_speed;
-                    int eta_minutes = static_cast<int>(remaining_time / 60);
-                    int eta_seconds = static_cast<int>(remaining_time) % 60;
-                    eta_str = " ETA: " + std::to_string(eta_minutes) + "m " + std::to_string(eta_seconds) + "s";
-                }
-
-                if (avg_speed > top_speed) top_speed = avg_speed;
-
-                Cursor::cr();
-                std::cout << "==: " << current << "/" << totalImages << " (bad: " << corrupted << ") "
-                          << std::fixed << std::setprecision(1)
-                          << p * 100 << "% (avg: " << std::setprecision(1) << avg_speed << " i/s)" << " (top: " << top_speed << " i/s)"
-                          << eta_str << "               ";
-                std::cout.flush();
-            }
-        }
-        std::cout << std::endl;
-    });
-
-    auto processImageThread = [&processedImages, &images](size_t start, size_t end, int threadId) {
-        UNUSED(threadId);
-        for (size_t i = start; i < end; ++i) {
-            ValidationResult result = validateImage(images[i]);
-            {
-                std::lock_guard<std::mutex> lock(resultsMutex);
-                results.push_back(result);
-            }
-            ++processedImages;
-        }
+    options.counters = 1;
+    options.label = [](const ShardedCounters& counters) {
+        return " (bad: " + std::to_string(counters.sum(CORRUPTED)) + ")";
     };
 
-    for (int t = 0; t < numThreads; ++t) {
-        size_t start = t * chunkSize;
-        size_t end = std::min(start + chunkSize, totalImages);
-        if (start >= totalImages) break;
-        threads.emplace_back(processImageThread, start, end, t);
-    }
-
-    for (auto& thread : threads) {
-        if (thread.joinable()) {
-            thread.join();
-        }
-    }
-
-    // stop print thread
-    running = false;
-    printThread.join();
-
-    auto endTime = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+    BatchReport report = processBatch(results, images, options, [&images, mode](size_t i, BatchContext& ctx) {
+        ValidationResult result = validateImage(images.at(i), ctx.file, mode);
+        if (!result.isValid) { ctx.count(CORRUPTED); }
+        return result;
+    });
+    corruptedCount = report.counters[CORRUPTED];
 
-    std::cout << "\nCompleted in " << duration.count() << "ms" << std::endl;
-    std::cout << "Average: " << std::fixed << std::setprecision(2)
-              << (double)duration.count() / images.size() << "ms per image" << std::endl;
     std::cout << "Total files processed: " << results.size() << std::endl;
     std::cout << "Valid images: " << (results.size() - corruptedCount) << std::endl;
     std::cout << "Corrupted/unreadable images: " << corruptedCount << std::endl;
 
     if (corruptedCount > 0) {
+        std::map<Verdict, size_t> verdictCounts;
+        for (const auto& result : results) {
+            if (!result.isValid) { verdictCounts[result.verdict]++; }
+        }
+        for (const auto& [verdict, count] : verdictCounts) {
+            std::cout << "  " << verdictName(verdict) << ": " << count << std::endl;
+        }
+
         std::cout << "\nCorrupted files:" << std::endl;
         for (const auto& result : results) {
             if (!result.isValid) {
-                std::cout << "  " << result.filePath << std::endl;
+                std::cout << "  " << result.filePath << " [" << verdictName(result.verdict) << "]" << std::endl;
             }
         }
     }
@@ -208,7 +133,7 @@ void deleteCorruptedFiles()
         return;
     }
 
-    char response;
+    char response = 'n'; // stays "no" if stdin is closed
     std::cout << "\nDo you want to DELETE all " << corruptedFiles.size()
               << " corrupted files? (y/N): ";
     std::cin >> response;
@@ -294,7 +219,7 @@ int main(int argc, char* argv[])
     program.add_description("validate images, find corrupt images (and delete them/move them/etc)");
     program.add_argument("-i", "--input")
         .required()
-        .help("Path to a image file or folder containing images (recursive)");
+        .help("Path to a image file or folder containing images (recursive), - reads NUL-delimited paths from stdin");
 
     program.add_argument("-m", "--move")
         .default_value(false)
@@ -311,6 +236,18 @@ int main(int argc, char* argv[])
         .implicit_value(true)
         .help("prompt what to do after scanning (nothing/delete/move)");
 
+    program.add_argument("-f", "--fast")
+        .default_value(false)
+        .implicit_value(true)
+        .help("only check container structure (markers, chunk CRCs, sizes, trailers), don't decode pixels");
+
+    program.add_argument("--deep")
+        .default_value(false)
+        .implicit_value(true)
+        .help("check container structure, then fully decode files that pass");
+
+    addBatchArguments(program);
+
     try {
         program.parse_args(argc, argv);
     }
@@ -320,6 +257,14 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    std::string inputPath = program.get<std::string>("input");
+
+    // the answers to the prompts come from stdin too
+    if (inputPath == "-" && (program.get<bool>("prompt") || program.get<bool>("delete"))) {
+        std::cout << "--prompt and --delete ask for confirmation on stdin, they can't be used with --input -" << std::endl;
+        return 1;
+    }
+
     int choice = 0;
 
     if      (program.get<bool>("delete")) { choice = 1; }
@@ -335,16 +280,17 @@ int main(int argc, char* argv[])
         std::cin >> choice;
     }
 
-    std::string inputPath = program.get<std::string>("input");
-    std::vector<std::string> images;
-    getImages(images, inputPath);
-    if (images.empty()) {
+    VALIDATION_MODE mode = DECODE;
+    if      (program.get<bool>("deep")) { mode = DEEP; }
+    else if (program.get<bool>("fast")) { mode = FAST; }
+
+    PathStream images;
+    BatchOptions options = batchOptionsFromArguments(program);
+    processStreamed(images, inputPath, options, [&] { processImages(images, mode, options); });
+    if (images.size() == 0) {
         std::cout << "No valid images found." << std::endl;
         return 1;
     }
-    results.reserve(images.size());
-
-    processImages(images);
 
     if (corruptedCount > 0) {
         switch (choice) {
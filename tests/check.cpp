@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "analysis.hpp"
+#include "kmeans.hpp"
+#include "utils.hpp"
+
+// `make test`: checks of claims the engine makes that the tools themselves never verify.
+//   wpu-check           runs every check, prints one line per check, exits 1 if any failed
+//   wpu-check --digest  prints the results of a fixed set of clusterings; a SIMD build and a KMEANS_SCALAR
+//                       build must print the same bytes
+//   wpu-check --bench-load  times FileBuffer::load through read() and mmap, alone and with the decode (`make bench`)
+// Images are synthetic and generated from fixed seeds, so every run checks the same pixels.
+
+static int failures = 0;
+
+static void expect(bool ok, const std::string& what)
+{
+    std::printf("%s  %s\n", ok ? "ok  " : "FAIL", what.c_str());
+    if (!ok) failures++;
+}
+
+// background and 4 discs in well separated colors, each channel jittered by up to ±noise
+static cv::Mat shapesImage(uint32_t seed, int noise, int width = 800, int height = 600)
+{
+    static const int colors[5][3] = {{40, 40, 40}, {220, 60, 30}, {30, 200, 60}, {60, 40, 210}, {200, 200, 210}};
+    std::mt19937 rng(seed);
+    int cx[5], cy[5], radius[5];
+    for (int d = 1; d < 5; d++) {
+        cx[d] = rng() % width;
+        cy[d] = rng() % height;
+        radius[d] = height / 8 + rng() % (height / 4);
+    }
+
+    cv::Mat image(height, width, CV_8UC3);
+    for (int y = 0; y < height; y++) {
+        cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < width; x++) {
+            int shape = 0;
+            for (int d = 1; d < 5; d++) {
+                if ((x - cx[d]) * (x - cx[d]) + (y - cy[d]) * (y - cy[d]) < radius[d] * radius[d]) shape = d;
+            }
+            for (int c = 0; c < 3; c++) {
+                int v = colors[shape][c] + (noise > 0 ? (int)(rng() % (2 * noise + 1)) - noise : 0);
+                row[x][c] = static_cast<uchar>(std::clamp(v, 0, 255));
+            }
+        }
+    }
+    return image;
+}
+
+// two-color horizontal gradient with a little noise, no clear clusters: k-means has to settle on a split
+static cv::Mat gradientImage(uint32_t seed, int width = 640, int height = 480)
+{
+    std::mt19937 rng(seed);
+    int from[3], to[3];
+    for (int c = 0; c < 3; c++) {
+        from[c] = rng() % 256;
+        to[c] = rng() % 256;
+    }
+
+    cv::Mat image(height, width, CV_8UC3);
+    for (int y = 0; y < height; y++) {
+        cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                int v = from[c] + (to[c] - from[c]) * x / width + (int)(rng() % 9) - 4;
+                row[x][c] = static_cast<uchar>(std::clamp(v, 0, 255));
+            }
+        }
+    }
+    return image;
+}
+
+// pairs every center of a with the nearest unused center of b, in order: worst distance and worst share difference
+static void matchCenters(const KmeansResult& a, const KmeansResult& b, size_t pixels, double& maxDistance, double& maxShare)
+{
+    maxDistance = 0.0;
+    maxShare = 0.0;
+    std::vector<bool> used(b.centers.size(), false);
+    for (size_t i = 0; i < a.centers.size(); i++) {
+        double best = 1e9;
+        size_t match = 0;
+        for (size_t j = 0; j < b.centers.size(); j++) {
+            if (used[j]) continue;
+            cv::Vec3f d = a.centers[i] - b.centers[j];
+            double distance = std::sqrt(d.dot(d));
+            if (distance < best) {
+                best = distance;
+                match = j;
+            }
+        }
+        used[match] = true;
+        maxDistance = std::max(maxDistance, best);
+        maxShare = std::max(maxShare, std::abs((double)a.counts[i] - (double)b.counts[match]) / pixels);
+    }
+}
+
+// median microseconds of `reps` calls
+template <typename F>
+static double medianMicros(int reps, F&& call)
+{
+    std::vector<double> times(reps);
+    for (double& time : times) {
+        auto start = std::chrono::steady_clock::now();
+        call();
+        time = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::nth_element(times.begin(), times.begin() + reps / 2, times.end());
+    return times[reps / 2];
+}
+
+// user-019: coarse to fine clustering ends within a few levels of clustering the analysis image directly
+static void checkPyramid()
+{
+    constexpr double MAX_DISTANCE = 4.0; // levels per channel, Euclidean
+    constexpr double MAX_SHARE = 0.02;   // of all pixels
+
+    for (uint32_t seed = 1; seed <= 4; seed++) {
+        cv::Mat image = shapesImage(seed, 12);
+        KmeansParams params;
+        params.k = 5;
+        KmeansResult direct = kmeansColors(image, params);
+        params.pyramid = 32;
+        KmeansResult pyramid = kmeansColors(image, params);
+
+        double distance, share;
+        matchCenters(direct, pyramid, image.total(), distance, share);
+        char what[160];
+        std::snprintf(what, sizeof(what), "pyramid vs direct, shapes %u: centers within %.2f (max %.1f), shares within %.3f (max %.2f)",
+                      seed, distance, MAX_DISTANCE, share, MAX_SHARE);
+        expect(pyramid.centers.size() == direct.centers.size() && distance <= MAX_DISTANCE && share <= MAX_SHARE, what);
+    }
+}
+
+// user-014: the engine finds the colors cv::kmeans finds on the same pixels with the same settings (k-means++,
+// 3 attempts, 20 iterations, epsilon 1), in less time. Times are printed, not checked: they depend on the machine
+static void checkAgainstOpenCV()
+{
+    constexpr double MAX_DISTANCE = 4.0; // levels per channel, Euclidean; the reference truncates centers to uchar
+    constexpr double MAX_SHARE = 0.02;   // of all pixels
+    constexpr int K = 5;
+
+    for (uint32_t seed = 1; seed <= 4; seed++) {
+        cv::Mat image = shapesImage(seed, 12);
+        KmeansParams params;
+        params.k = K;
+        std::vector<ColorInfo> colors;
+        KmeansResult engine;
+        double opencvTime = medianMicros(5, [&] { colors = extractDominantColorsKmeansOpenCV(image, K); });
+        double engineTime = medianMicros(5, [&] { engine = kmeansColors(image, params); });
+
+        KmeansResult reference;
+        for (const ColorInfo& color : colors) {
+            reference.centers.push_back(cv::Vec3f(color.color[0], color.color[1], color.color[2]));
+            reference.counts.push_back(static_cast<size_t>(std::llround(color.weight * image.total())));
+        }
+
+        double distance, share;
+        matchCenters(reference, engine, image.total(), distance, share);
+        char what[200];
+        std::snprintf(what, sizeof(what),
+                      "engine vs cv::kmeans, shapes %u: centers within %.2f (max %.1f), shares within %.3f (max %.2f), "
+                      "%.2f vs %.2f ms (%.1fx)",
+                      seed, distance, MAX_DISTANCE, share, MAX_SHARE, engineTime / 1000, opencvTime / 1000, opencvTime / engineTime);
+        expect(engine.centers.size() == colors.size() && distance <= MAX_DISTANCE && share <= MAX_SHARE, what);
+    }
+}
+
+// user-014: an anchor that pixels vote for but histogram peaks then take all their pixels from starts empty. Refilling
+// it must not empty the donor: in the histogram variant the largest cluster is the grey alone, also the farthest
+// point, so the point has to come from the cluster of the two reds
+static void checkEmptyClusters()
+{
+    static const cv::Vec3b colors[4] = {{40, 40, 40}, {220, 60, 30}, {220, 60, 60}, {180, 180, 180}};
+    cv::Mat image(100, 100, CV_8UC3);
+    for (int y = 0; y < image.rows; y++) {
+        for (int x = 0; x < image.cols; x++) image.ptr<cv::Vec3b>(y)[x] = colors[x < 55 ? 3 : x < 80 ? 0 : x < 90 ? 1 : 2];
+    }
+
+    const char* variants[3] = {"pixels", "bounded", "histogram"};
+    for (int variant = 0; variant < 3; variant++) {
+        KmeansParams params;
+        params.k = 4;
+        params.maxIterations = 1; // the result is the state right after the refill, later iterations can hide it
+        params.seeding = KmeansSeeding::ANCHORS;
+        params.anchors = {cv::Vec3f(80, 80, 80), cv::Vec3f(200, 200, 200)};
+        params.bounded = variant == 1;
+        KmeansResult result = variant == 2 ? kmeansHistogram(image, params) : kmeansColors(image, params);
+
+        size_t empty = 0, total = 0;
+        bool finite = true;
+        for (size_t c = 0; c < result.centers.size(); c++) {
+            for (int j = 0; j < 3; j++) finite = finite && std::isfinite(result.centers[c][j]);
+            empty += result.counts[c] == 0;
+            total += result.counts[c];
+        }
+        char what[160];
+        std::snprintf(what, sizeof(what), "empty cluster refilled, %s: %zu centers, %zu empty, centers %s", variants[variant],
+                      result.centers.size(), empty, finite ? "finite" : "NOT finite");
+        expect(result.centers.size() == 4 && empty == 0 && finite && total == image.total(), what);
+    }
+}
+
+// user-022: calculateColorProperties converts every 8-bit BGR color exactly like cv::cvtColor(COLOR_BGR2HSV)
+static void checkHsv()
+{
+    cv::Mat all(4096, 4096, CV_8UC3);
+    for (int i = 0; i < 1 << 24; i++) all.ptr<cv::Vec3b>(i >> 12)[i & 4095] = cv::Vec3b(i & 255, (i >> 8) & 255, i >> 16);
+    cv::Mat hsv;
+    cv::cvtColor(all, hsv, cv::COLOR_BGR2HSV);
+
+    int mismatches = 0;
+    int first = -1;
+    for (int i = 0; i < 1 << 24; i++) {
+        const cv::Vec3b& expected = hsv.ptr<cv::Vec3b>(i >> 12)[i & 4095];
+        ColorInfo info;
+        info.color = all.ptr<cv::Vec3b>(i >> 12)[i & 4095];
+        calculateColorProperties(info);
+        if (info.hue != expected[0] * 2.0 || info.saturation != expected[1] / 255.0 || info.brightness != expected[2] / 255.0) {
+            if (mismatches++ == 0) first = i;
+        }
+    }
+
+    char what[160];
+    if (mismatches == 0) std::snprintf(what, sizeof(what), "HSV conversion matches cv::cvtColor on all 2^24 colors");
+    else std::snprintf(what, sizeof(what), "HSV conversion differs from cv::cvtColor on %d colors, first BGR %d %d %d",
+                       mismatches, first & 255, (first >> 8) & 255, first >> 16);
+    expect(mismatches == 0, what);
+}
+
+// user-022: assignGroup's per-group tables pick the same group with the same score as calculateGroupScore. The
+// terms are the same doubles, but with -march=native the compiler may fuse the weighted sums into FMAs in one
+// path and not the other, which rounds the last bit differently: scores are compared within SCORE_EPSILON and
+// sets whose two best groups are closer than that are not counted
+static void checkGroupTables()
+{
+    constexpr int SETS = 200000;
+    constexpr double SCORE_EPSILON = 1e-12;
+    std::mt19937 rng(22);
+    int mismatches = 0;
+    for (int set = 0; set < SETS; set++) {
+        std::vector<ColorInfo> colors(DOMINANT_COLORS);
+        for (ColorInfo& color : colors) {
+            color.color = cv::Vec3b(rng() % 256, rng() % 256, rng() % 256);
+            color.weight = (1 + rng() % 1000) / 1000.0;
+            calculateColorProperties(color);
+        }
+
+        double score;
+        size_t group = assignGroup(colors, score);
+        double expectedScore = 0.0, runnerUp = 0.0;
+        size_t expectedGroup = 0;
+        for (size_t g = 1; g < colorGroups.size(); g++) {
+            double s = calculateGroupScore(colors, colorGroups[g]);
+            if (s > expectedScore) {
+                runnerUp = expectedScore;
+                expectedScore = s;
+                expectedGroup = g;
+            }
+            else runnerUp = std::max(runnerUp, s);
+        }
+        if (expectedScore - runnerUp < SCORE_EPSILON || std::abs(expectedScore - 0.3) < SCORE_EPSILON) continue;
+        if (expectedScore < 0.3) expectedGroup = 0;
+        if (group != expectedGroup || std::abs(score - expectedScore) > SCORE_EPSILON) mismatches++;
+    }
+    expect(mismatches == 0, "group tables match calculateGroupScore on " + std::to_string(SETS) + " random color sets, " +
+                                std::to_string(mismatches) + " differ");
+}
+
+// the group of an image of only this color
+static size_t colorGroup(const cv::Vec3b& color)
+{
+    std::vector<ColorInfo> single(1);
+    single[0].color = color;
+    single[0].weight = 1.0;
+    calculateColorProperties(single[0]);
+    double score;
+    return assignGroup(single, score);
+}
+
+// the group GROUP_VOTE looks a color up to: the group of the center of its 32³ bin
+static size_t voteGroup(const cv::Vec3b& color)
+{
+    return colorGroup(cv::Vec3b((color[0] & ~7) + 4, (color[1] & ~7) + 4, (color[2] & ~7) + 4));
+}
+
+// user-024: each GROUP_VOTE color looks up to its own group, so no two colors share one, also when the fullest
+// bin of the image (here bin 0, black) belongs to another group than the one falling back to its fullest bin
+static void checkGroupVoteColors()
+{
+    constexpr int IMAGES = 500;
+    std::mt19937 rng(24);
+    int wrong = 0;
+    for (int n = 0; n < IMAGES; n++) {
+        std::vector<cv::Vec3b> palette(2 + rng() % 30);
+        for (cv::Vec3b& color : palette) color = cv::Vec3b(rng() % 256, rng() % 256, rng() % 256);
+        cv::Mat image(100, 150, CV_8UC3);
+        for (int y = 0; y < image.rows; y++) {
+            cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < image.cols; x++) row[x] = x < 50 ? cv::Vec3b(0, 0, 0) : palette[rng() % palette.size()];
+        }
+
+        std::vector<ColorInfo> colors = extractDominantColorsGroupVote(image, colorGroups.size());
+        std::vector<bool> taken(colorGroups.size(), false);
+        for (const ColorInfo& color : colors) {
+            size_t group = voteGroup(color.color);
+            if (taken[group]) {
+                wrong++;
+                break;
+            }
+            taken[group] = true;
+        }
+    }
+    expect(wrong == 0, "group vote colors look up to distinct groups on " + std::to_string(IMAGES) + " random images, " +
+                           std::to_string(wrong) + " don't");
+}
+
+// user-024: on images of one color (±2 per channel) GROUP_VOTE picks the group KMeans scoring picks, the group of
+// that color. Colors whose bin center lies in another group than they do are skipped: near a group boundary the
+// vote goes by the bin and may differ
+static void checkGroupVoteAgreement()
+{
+    std::mt19937 rng(2024);
+    int checked = 0, disagree = 0;
+    std::string first;
+    for (size_t g = 1; g < colorGroups.size(); g++) {
+        const cv::Vec3b base = colorGroups[g].representativeColor;
+        size_t expected = colorGroup(base);
+        if (expected == 0 || voteGroup(base) != expected) continue;
+
+        cv::Mat image(120, 160, CV_8UC3);
+        for (int y = 0; y < image.rows; y++) {
+            cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < image.cols; x++) {
+                for (int c = 0; c < 3; c++) row[x][c] = static_cast<uchar>(std::clamp((int)base[c] + (int)(rng() % 5) - 2, 0, 255));
+            }
+        }
+
+        double score;
+        size_t vote = assignGroup(extractDominantColors(image, GROUP_VOTE), GROUP_VOTE, score);
+        size_t kmeans = assignGroup(extractDominantColors(image, KMEANS), KMEANS, score);
+        checked++;
+        if (vote != expected || kmeans != expected) {
+            if (disagree++ == 0) first = colorGroups[g].name + " (vote " + colorGroups[vote].name + ", kmeans " + colorGroups[kmeans].name + ")";
+        }
+    }
+    expect(checked > 0 && disagree == 0, "group vote and KMeans agree on " + std::to_string(checked) + " single color images" +
+                              (disagree > 0 ? ", " + std::to_string(disagree) + " differ, first " + first : ""));
+}
+
+static void printResult(const char* name, const KmeansResult& result)
+{
+    std::printf("%s: iterations %d compactness %.3f\n", name, result.iterations, result.compactness);
+    for (size_t c = 0; c < result.centers.size(); c++) {
+        std::printf("  %.4f %.4f %.4f %zu\n", result.centers[c][0], result.centers[c][1], result.centers[c][2], result.counts[c]);
+    }
+}
+
+// user-014: every kernel (AVX2, SSE4.1, scalar) assigns the same labels, so everything built on them matches
+static void printDigest()
+{
+    std::vector<cv::Mat> images = {shapesImage(11, 30), shapesImage(12, 4, 150, 100), gradientImage(13)};
+    const int ks[] = {1, 2, 3, 4, 5, 6, 7, 8, 12, 16};
+    const KmeansSeeding seedings[] = {KmeansSeeding::PLUS_PLUS, KmeansSeeding::ANCHORS, KmeansSeeding::PEAKS};
+    const char* seedingNames[] = {"pp", "anchors", "peaks"};
+
+    for (size_t i = 0; i < images.size(); i++) {
+        std::printf("image %zu\n", i);
+        for (int k : ks) {
+            for (int s = 0; s < 3; s++) {
+                KmeansParams params;
+                params.k = k;
+                params.seeding = seedings[s];
+                params.anchors = {cv::Vec3f(40, 40, 40), cv::Vec3f(220, 60, 30), cv::Vec3f(30, 200, 60), cv::Vec3f(200, 200, 210)};
+                char name[64];
+                std::snprintf(name, sizeof(name), "k=%d %s", k, seedingNames[s]);
+                printResult(name, kmeansColors(images[i], params));
+            }
+
+            KmeansParams params;
+            params.k = k;
+            params.seeding = KmeansSeeding::ANCHORS;
+            for (int a = 0; a < 20; a++) params.anchors.push_back(cv::Vec3f(a * 13 % 256, a * 71 % 256, a * 157 % 256));
+            printResult("20 anchors", kmeansColors(images[i], params));
+            params.seeding = KmeansSeeding::PLUS_PLUS;
+            params.anchors.clear();
+            params.bounded = true;
+            printResult("bounded", kmeansColors(images[i], params));
+            params.bounded = false;
+            params.pyramid = 32;
+            printResult("pyramid", kmeansColors(images[i], params));
+            params.pyramid = 0;
+            params.miniBatch = 4096;
+            printResult("mini-batch", kmeansColors(images[i], params));
+            params.miniBatch = 0;
+            printResult("histogram", kmeansHistogram(images[i], params));
+            printResult("median cut", medianCutColors(images[i], k));
+        }
+    }
+}
+
+// user-009: where mmap starts to beat read() (MMAP_THRESHOLD), on JPEGs from 64x48 to 6000x4000 in the page cache
+static void benchLoad()
+{
+    const int sizes[][2] = {{64, 48}, {160, 120}, {320, 240}, {480, 360}, {640, 480}, {1024, 768}, {1920, 1440}, {4000, 3000}, {6000, 4000}};
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "wpu-check-load";
+    std::filesystem::create_directories(dir);
+
+    std::printf("%10s %12s %12s %16s %16s   (us per file, median)\n", "bytes", "read()", "mmap", "read()+decode", "mmap+decode");
+    for (const auto& size : sizes) {
+        std::vector<uchar> jpeg;
+        cv::imencode(".jpg", shapesImage(size[0], 30, size[0], size[1]), jpeg, {cv::IMWRITE_JPEG_QUALITY, 95});
+        std::string path = (dir / (std::to_string(size[0]) + ".jpg")).string();
+        std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(jpeg.data()), jpeg.size());
+
+        int reps = std::clamp<int>(static_cast<int>((size_t(64) << 20) / std::max<size_t>(jpeg.size(), 1)), 5, 2000);
+        auto load = [&path](LoadMode mode) {
+            FileBuffer file;
+            file.load(path, mode);
+        };
+        auto decode = [&path](LoadMode mode) {
+            FileBuffer file;
+            file.load(path, mode);
+            decodeImage(path, &file);
+        };
+        double readLoad = medianMicros(reps, [&] { load(LoadMode::READ); });
+        double mmapLoad = medianMicros(reps, [&] { load(LoadMode::MMAP); });
+        int decodeReps = std::max(3, reps / 20);
+        double readDecode = medianMicros(decodeReps, [&] { decode(LoadMode::READ); });
+        double mmapDecode = medianMicros(decodeReps, [&] { decode(LoadMode::MMAP); });
+        std::printf("%10zu %12.1f %12.1f %16.1f %16.1f\n", jpeg.size(), readLoad, mmapLoad, readDecode, mmapDecode);
+    }
+    std::printf("MMAP_THRESHOLD is %zu bytes\n", MMAP_THRESHOLD);
+    std::filesystem::remove_all(dir);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::strcmp(argv[1], "--digest") == 0) {
+        printDigest();
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "--bench-load") == 0) {
+        benchLoad();
+        return 0;
+    }
+
+    checkPyramid();
+    checkAgainstOpenCV();
+    checkEmptyClusters();
+    checkHsv();
+    checkGroupTables();
+    checkGroupVoteColors();
+    checkGroupVoteAgreement();
+
+    std::printf("%s\n", failures == 0 ? "all checks passed" : (std::to_string(failures) + " checks failed").c_str());
+    return failures == 0 ? 0 : 1;
+}